@@ -3,9 +3,12 @@
 #include <vector>
 #include <fstream>
 #include <memory>
+#include <atomic>
+#include <mutex>
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #include <boost/filesystem.hpp>
+#include "utils.h"
 
 
 enum FileOrigin
@@ -16,13 +19,25 @@ enum FileOrigin
 };
 
 
+class BlockView;
+
 class BlockBase
 {
 public:
     BlockBase() : references(0) {}
+    //copies start with their own reference count
+    BlockBase(const BlockBase &) : references(0) {}
+    BlockBase &operator=(const BlockBase &) { return *this; }
     virtual ~BlockBase() {}
     //virtual get method
     virtual void Read(void *data, size_t offset, size_t size) = 0;
+    //pointer to block contents if the block is backed by memory, nullptr otherwise
+    virtual const void *Map(size_t /*offset*/, size_t /*size*/)
+    {
+        return nullptr;
+    }
+    //stable view of block contents, copies only if the block can't be mapped
+    virtual BlockView View(size_t offset, size_t size);
     //template get methods
     template <typename T>
     T Get(size_t offset)
@@ -47,18 +62,18 @@ public:
     }
     //size of block
     virtual size_t Size() = 0;
-    size_t references;
+    std::atomic<size_t> references;
 };
 
 
 //typedef std::shared_ptr<BlockBase> BlockPtr;
 template <typename X>
 inline void intrusive_ptr_add_ref(X* x) {
-    ++x->references;
+    x->references.fetch_add(1, std::memory_order_relaxed);
 }
 template <typename X>
 inline void intrusive_ptr_release(X* x) {
-    if (--x->references == 0)
+    if (x->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
         delete x;
 }
 
@@ -66,53 +81,195 @@ inline void intrusive_ptr_release(X* x) {
 typedef boost::intrusive_ptr<BlockBase> BlockPtr;
 
 
+//non-owning span over block contents, keeps the backing block alive
+class BlockView
+{
+public:
+    BlockView()
+        : data(nullptr)
+        , size(0)
+    {
+    }
+    BlockView(BlockPtr owner, const void *data, size_t size)
+        : owner(owner)
+        , data(static_cast<const unsigned char*>(data))
+        , size(size)
+    {
+    }
+    const unsigned char *Data() const
+    {
+        return data;
+    }
+    template <typename T>
+    const T *As() const
+    {
+        static_assert(std::is_trivial<T>::value, "Only trivial objects can be viewed");
+        return reinterpret_cast<const T*>(data);
+    }
+    size_t Size() const
+    {
+        return size;
+    }
+private:
+    BlockPtr owner;
+    const unsigned char *data;
+    size_t size;
+};
+
+
 
+//stateless disk block: one descriptor, positional reads, safe to share between threads
 class BlockDisk : public BlockBase
 {
 public:
-    BlockDisk(const wchar_t *fileName)
-        : fileName_(fileName)
+    BlockDisk(const PathChar *fileName)
+        : file(OpenFileRead(fileName))
+    {
+        fileSize = size_t(FileSize(file));
+    }
+    BlockDisk(const BlockDisk &) = delete;
+    BlockDisk &operator=(const BlockDisk &) = delete;
+    virtual ~BlockDisk()
     {
-        Open();
-        file.seekg(0, std::ios_base::end);
-        fileSize = size_t(file.tellg());
-        file.seekg(0, std::ios_base::beg);
-        Close();
+        CloseFile(file);
     }
     virtual void Read(void *data, size_t offset, size_t size) override
     {
         if (offset + size > fileSize)
             throw std::runtime_error("Going beyond file");
+        ReadFileAt(file, data, offset, size);
+    }
+    virtual size_t Size() override
+    {
+        return fileSize;
+    }
+private:
+    FileHandle file;
+    size_t fileSize;
+};
 
-        Open();
-        file.seekg(offset);
-        file.read((char*)data, size);
-        if (!file.good())
+//disk block bypassing the page cache. Unaligned requests go through an aligned window that is
+//kept between calls, so the block shared by two consecutive requests is read from disk once.
+class BlockDiskDirect : public BlockBase
+{
+public:
+    BlockDiskDirect(const PathChar *fileName)
+        : file(OpenFileRead(fileName, true))
+        , window(nullptr, &FreeAligned)
+        , windowCapacity(0)
+        , windowBegin(0)
+        , windowEnd(0)
+    {
+        fileSize = size_t(FileSize(file));
+    }
+    BlockDiskDirect(const BlockDiskDirect &) = delete;
+    BlockDiskDirect &operator=(const BlockDiskDirect &) = delete;
+    virtual ~BlockDiskDirect()
+    {
+        CloseFile(file);
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        if (offset + size > fileSize)
+            throw std::runtime_error("Going beyond file");
+        if (size == 0)
+            return;
+        const size_t mask = DirectIoAlignment - 1;
+        const size_t maxReadSize = 8 << 20;
+        if (((offset | size | reinterpret_cast<uintptr_t>(data)) & mask) == 0)
+        {
+            if (ReadFileAtDirect(file, data, offset, size) != size)
+                throw std::runtime_error("File read error");
+            return;
+        }
+        std::lock_guard<std::mutex> lock(windowMutex);
+        unsigned char *dst = static_cast<unsigned char*>(data);
+        size_t position = offset;
+        const size_t end = offset + size;
+        while (position < end)
         {
-            Close();
-            throw std::runtime_error("File read error");
+            //whatever the window already holds, usually the tail block of the previous request
+            if (position >= windowBegin && position < windowEnd)
+            {
+                size_t copyEnd = std::min(end, windowEnd);
+                std::memcpy(dst + (position - offset), window.get() + (position - windowBegin), copyEnd - position);
+                position = copyEnd;
+                continue;
+            }
+            size_t readBegin = position & ~mask;
+            size_t readSize = std::min(((end + mask) & ~mask) - readBegin, maxReadSize);
+            if (readSize > windowCapacity)
+            {
+                window.reset();
+                windowEnd = windowBegin = 0;
+                window.reset(static_cast<unsigned char*>(AllocateAligned(readSize, DirectIoAlignment)));
+                windowCapacity = readSize;
+            }
+            size_t available = size_t(ReadFileAtDirect(file, window.get(), readBegin, readSize));
+            windowBegin = readBegin;
+            windowEnd = readBegin + std::min(available, readSize);
+            if (windowEnd <= position)
+                throw std::runtime_error("File read error");
         }
-        Close();
     }
     virtual size_t Size() override
     {
         return fileSize;
     }
 private:
-    void Open()
+    FileHandle file;
+    size_t fileSize;
+    std::unique_ptr<unsigned char, void(*)(void*)> window;
+    size_t windowCapacity;
+    size_t windowBegin;
+    size_t windowEnd;
+    std::mutex windowMutex;
+};
+
+//whole file mapped read-only, views are served straight from the mapping
+class BlockMapped : public BlockBase
+{
+public:
+    BlockMapped(const PathChar *fileName)
+        : data(nullptr)
     {
-        if (!file.good())
+        FileHandle file = OpenFileRead(fileName);
+        try
+        {
+            fileSize = size_t(FileSize(file));
+            if (fileSize)
+                data = static_cast<const unsigned char*>(MapFileRead(file, fileSize));
+        }
+        catch (...)
         {
-            throw std::runtime_error("File open error");
+            CloseFile(file);
+            throw;
         }
-        file.open(fileName_, std::ios::binary);
+        CloseFile(file);
     }
-    void Close()
+    BlockMapped(const BlockMapped &) = delete;
+    BlockMapped &operator=(const BlockMapped &) = delete;
+    virtual ~BlockMapped()
     {
-        file.close();
+        if (data)
+            UnmapFile(data, fileSize);
     }
-    std::wstring fileName_;
-    std::ifstream  file;
+    virtual void Read(void *dst, size_t offset, size_t size) override
+    {
+        std::memcpy(dst, Map(offset, size), size);
+    }
+    virtual const void *Map(size_t offset, size_t size) override
+    {
+        if (offset + size > fileSize)
+            throw std::runtime_error("Going beyond file");
+        return data + offset;
+    }
+    virtual size_t Size() override
+    {
+        return fileSize;
+    }
+private:
+    const unsigned char *data;
     size_t fileSize;
 };
 
@@ -141,6 +298,12 @@ public:
             throw std::runtime_error("Memory file index out of range");
         std::memcpy(data, blockData.get() + offset, size);
     }
+    virtual const void *Map(size_t offset, size_t size) override
+    {
+        if (offset + size > blockSize)
+            throw std::runtime_error("Memory file index out of range");
+        return blockData.get() + offset;
+    }
     virtual size_t Size() override
     {
         return blockSize;
@@ -157,7 +320,7 @@ public:
         : size_(size), offset_(offset), file_(file)
     {
         if (offset_ + size_ > file->Size())
-            throw std::exception("File create error: part file");
+            throw std::runtime_error("File create error: part file");
         BlockPart *sourceFile = dynamic_cast<BlockPart*>(file.get());
         if (sourceFile)
         {
@@ -168,9 +331,15 @@ public:
     virtual void Read(void *data, size_t offset, size_t size) override
     {
         if (offset + size > size_)
-            throw std::exception("File read error: part file");
+            throw std::runtime_error("File read error: part file");
         return file_->Read(data, offset + offset_, size);
     }
+    virtual const void *Map(size_t offset, size_t size) override
+    {
+        if (offset + size > size_)
+            throw std::runtime_error("File map error: part file");
+        return file_->Map(offset + offset_, size);
+    }
     virtual size_t Size() override
     {
         return size_;
@@ -181,17 +350,67 @@ private:
     size_t size_;
 };
 
+//concatenation of two blocks, reads are forwarded without copying either side
+class BlockPair : public BlockBase
+{
+public:
+    BlockPair(BlockPtr first, BlockPtr second)
+        : first(first), second(second), firstSize(first->Size())
+    {
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        if (offset + size > Size())
+            throw std::runtime_error("Pair file index out of range");
+        unsigned char *dst = static_cast<unsigned char*>(data);
+        if (offset < firstSize)
+        {
+            size_t firstPart = std::min(size, firstSize - offset);
+            first->Read(dst, offset, firstPart);
+            dst += firstPart;
+            offset += firstPart;
+            size -= firstPart;
+        }
+        if (size)
+            second->Read(dst, offset - firstSize, size);
+    }
+    virtual const void *Map(size_t offset, size_t size) override
+    {
+        if (offset + size > Size())
+            throw std::runtime_error("Pair file index out of range");
+        if (offset + size <= firstSize)
+            return first->Map(offset, size);
+        if (offset >= firstSize)
+            return second->Map(offset - firstSize, size);
+        return nullptr;
+    }
+    virtual size_t Size() override
+    {
+        return firstSize + second->Size();
+    }
+private:
+    BlockPtr first;
+    BlockPtr second;
+    size_t firstSize;
+};
+
+BlockView BlockBase::View(size_t offset, size_t size)
+{
+    if (const void *mapped = Map(offset, size))
+        return BlockView(BlockPtr(this), mapped, size);
+    std::unique_ptr<unsigned char[]> data = std::make_unique<unsigned char[]>(size);
+    Read(data.get(), offset, size);
+    BlockPtr copy(new BlockMemory(std::move(data), size));
+    return BlockView(copy, copy->Map(0, size), size);
+}
+
 BlockPtr MakeBlockPart(BlockPtr base, size_t offset, size_t size)
 {
     return BlockPtr(new BlockPart(base, offset, size));
 }
 BlockPtr MakeBlockPair(BlockPtr block1, BlockPtr block2)
 {
-    size_t size = block1->Size() + block2->Size();
-    std::unique_ptr<unsigned char[]> data = std::make_unique<unsigned char[]>(size);
-    block1->Get(data.get(), 0, block1->Size());
-    block2->Get(data.get() + block1->Size(), 0, block2->Size());
-    return BlockPtr(new BlockMemory(std::move(data), size));
+    return BlockPtr(new BlockPair(block1, block2));
 }
 template <typename T>
 BlockPtr MakeBlockMemory(const std::vector<T> &data)
@@ -210,14 +429,30 @@ BlockPtr MakeBlockMemory(std::unique_ptr<unsigned char[]>  &&data, size_t size)
 {
     return BlockPtr(new BlockMemory(std::move(data), size));
 }
-BlockPtr MakeBlockDisk(const wchar_t *filePath)
+BlockPtr MakeBlockDisk(const PathChar *filePath)
 {
     return BlockPtr(new BlockDisk(filePath));
 }
-BlockPtr MakeBlockDisk(const std::wstring &filePath)
+BlockPtr MakeBlockDisk(const PathString &filePath)
 {
     return MakeBlockDisk(filePath.c_str());
 }
+BlockPtr MakeBlockMapped(const PathChar *filePath)
+{
+    return BlockPtr(new BlockMapped(filePath));
+}
+BlockPtr MakeBlockMapped(const PathString &filePath)
+{
+    return MakeBlockMapped(filePath.c_str());
+}
+BlockPtr MakeBlockDiskDirect(const PathChar *filePath)
+{
+    return BlockPtr(new BlockDiskDirect(filePath));
+}
+BlockPtr MakeBlockDiskDirect(const PathString &filePath)
+{
+    return MakeBlockDiskDirect(filePath.c_str());
+}
 
 template <typename T>
 class DataArray
@@ -251,7 +486,7 @@ public:
         const T &dereference() const
         {
             if (iter < iterBegin || iter >= iterEnd)
-                throw std::exception("Index out of range");
+                throw std::runtime_error("Index out of range");
             return *iter;
         }
         bool equal(const Iterator &z) const
@@ -264,14 +499,18 @@ public:
         const T* iterEnd;
     };
     DataArray()
-        : offset(0)
+        : data(nullptr)
         , count(0)
     {
     }
     DataArray(const BlockPtr &block, size_t offset, size_t count)
-        : offset(offset)
+        : DataArray(block->View(offset, count*sizeof(T)), count)
+    {
+    }
+    DataArray(const BlockView &view, size_t count)
+        : view(Aligned(view))
+        , data(this->view.As<T>())
         , count(count)
-        , data(std::move(block->Get<T>(offset, count)))
     {
     }
     size_t Size()
@@ -282,24 +521,33 @@ public:
     {
         //ERROR_STACK(index);
         if (index >= count)
-            throw std::exception("Array index out of range");
+            throw std::runtime_error("Array index out of range");
         return data[index];
     }
     Iterator begin() const
     {
-        return Iterator(data.get(), count);
+        return Iterator(data, count);
     }
     Iterator end() const
     {
-        return Iterator(data.get(), count) + count;
+        return Iterator(data, count) + count;
     }
     operator bool() const
     {
         return count != 0;
     }
 private:
-    std::unique_ptr<T[]> data;
-    size_t offset;
+    //views at an offset misaligned for T are copied, T can't be read through them in place
+    static BlockView Aligned(const BlockView &view)
+    {
+        if (reinterpret_cast<uintptr_t>(view.Data()) % alignof(T) == 0)
+            return view;
+        BlockPtr copy = MakeBlockMemory(view.Data(), view.Size());
+        return copy->View(0, view.Size());
+    }
+
+    BlockView view;
+    const T *data;
     size_t count;
 };
 
@@ -333,21 +581,21 @@ public:
         case FileOriginBegin:
         {
             if (newPosition > Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position = newPosition;
         }
         break;
         case FileOriginCurrent:
         {
             if (newPosition + position> Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position += newPosition;
         }
         break;
         case FileOriginEnd:
         {
             if (newPosition > Size())
-                throw std::exception("File seek error: virtual file");
+                throw std::runtime_error("File seek error: virtual file");
             position = Size() - newPosition;
         }
         break;
@@ -357,6 +605,23 @@ public:
     {
         return block->Read(data, offset, size);
     }
+    virtual const void *Map(size_t offset, size_t size) override
+    {
+        return block->Map(offset, size);
+    }
+    //File lives on the stack, views must be owned by the underlying block
+    virtual BlockView View(size_t offset, size_t size) override
+    {
+        return block->View(offset, size);
+    }
+    inline BlockView View(size_t size)
+    {
+        size_t oldPos = position;
+        if (size + position > Size())
+            throw std::runtime_error("File view error: virtual file");
+        position += size;
+        return block->View(oldPos, size);
+    }
     template <typename T>
     inline T Read()
     {
@@ -379,7 +644,7 @@ public:
     {
         size_t oldPos = position;
         if (size + position> Size())
-            throw std::exception("File part error: virtual file");
+            throw std::runtime_error("File part error: virtual file");
         position += size;
         return MakeBlockPart(block, oldPos, size);
     }
@@ -392,9 +657,9 @@ public:
     {
         size_t oldPosition = position;
         if (sizeof(T)*elementCount + position> Size())
-            throw std::exception("File part error: virtual file");
+            throw std::runtime_error("File part error: virtual file");
         position += sizeof(T)*elementCount;
-        return ReadArray<T>(block, oldPosition, elementCount);
+        return DataArray<T>(block->View(oldPosition, sizeof(T)*elementCount), elementCount);
     }
     void Align(size_t aligment)
     {
@@ -410,30 +675,56 @@ private:
 };
 
 
-File MakeFileDisk(const wchar_t *filePath)
+File MakeFileDisk(const PathChar *filePath)
 {
     return File(MakeBlockDisk(filePath));
 }
-File MakeFileDisk(const std::wstring &filePath)
+File MakeFileDisk(const PathString &filePath)
 {
     return MakeFileDisk(filePath.c_str());
 }
 
-void WriteBlock(BlockPtr block, const wchar_t *filePath)
+//streams are written one window at a time, memory use doesn't depend on block size
+const size_t WriteWindowSize = 0x100000;
+
+void WriteBlock(BlockPtr block, std::ostream &stream)
+{
+    //aligned so reads from a BlockDiskDirect at aligned offsets go straight to disk
+    std::unique_ptr<char, void(*)(void*)> buffer(nullptr, &FreeAligned);
+    size_t size = block->Size();
+    for (size_t offset = 0; offset < size; offset += WriteWindowSize)
+    {
+        size_t windowSize = std::min(WriteWindowSize, size - offset);
+        if (const void *mapped = block->Map(offset, windowSize))
+        {
+            stream.write(static_cast<const char*>(mapped), windowSize);
+        }
+        else
+        {
+            if (!buffer)
+                buffer.reset(static_cast<char*>(AllocateAligned(std::min(WriteWindowSize, size), DirectIoAlignment)));
+            block->Read(buffer.get(), offset, windowSize);
+            stream.write(buffer.get(), windowSize);
+        }
+    }
+    if (!stream.good())
+        throw std::runtime_error("File write error");
+}
+void WriteBlock(BlockPtr block, const PathChar *filePath)
 {
     std::ofstream file(filePath, std::ios::binary);
-    file.write(block->Get<char>(0, block->Size()).get(), block->Size());
+    WriteBlock(block, file);
 }
-void WriteBlock(BlockPtr block, const std::wstring &filePath)
+void WriteBlock(BlockPtr block, const PathString &filePath)
 {
     WriteBlock(block, filePath.c_str());
 }
-void WriteBlockApp(BlockPtr block, const wchar_t *filePath)
+void WriteBlockApp(BlockPtr block, const PathChar *filePath)
 {
     std::ofstream file(filePath, std::ios::binary | std::ios::app | std::ios::ate);
-    file.write(block->Get<char>(0, block->Size()).get(), block->Size());
+    WriteBlock(block, file);
 }
-void WriteBlockApp(BlockPtr block, const std::wstring &filePath)
+void WriteBlockApp(BlockPtr block, const PathString &filePath)
 {
     WriteBlockApp(block, filePath.c_str());
 }
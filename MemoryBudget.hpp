@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+
+//global cap on bytes held by in-flight work, zero limit means unbounded
+class MemoryBudget
+{
+public:
+    MemoryBudget(uint64_t limit = 0)
+        : limit(limit), used(0)
+    {
+    }
+    //blocks until size fits, oversized requests wait to run alone; returns the amount to release
+    uint64_t Acquire(uint64_t size)
+    {
+        if (limit == 0)
+            return 0;
+        size = std::min(size, limit);
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return used == 0 || used + size <= limit; });
+        used += size;
+        return size;
+    }
+    void Release(uint64_t size)
+    {
+        if (size == 0)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            used -= size;
+        }
+        released.notify_all();
+    }
+    uint64_t Limit() const
+    {
+        return limit;
+    }
+private:
+    uint64_t limit;
+    uint64_t used;
+    std::mutex mutex;
+    std::condition_variable released;
+};
+
+class MemoryReservation
+{
+public:
+    MemoryReservation(MemoryBudget &budget, uint64_t size)
+        : budget(budget), size(budget.Acquire(size))
+    {
+    }
+    MemoryReservation(const MemoryReservation &) = delete;
+    MemoryReservation &operator=(const MemoryReservation &) = delete;
+    ~MemoryReservation()
+    {
+        budget.Release(size);
+    }
+private:
+    MemoryBudget &budget;
+    uint64_t size;
+};
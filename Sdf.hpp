@@ -0,0 +1,529 @@
+#pragma once
+#include "BasicFile.hpp"
+#include "utils.h"
+#include <zlib.h>
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <boost/format.hpp>
+
+#pragma pack(push,1)
+struct SdfTocHeader
+{
+    uint32_t fileTag; //0x54534557
+    uint32_t fileVersion;
+    uint32_t decompressedSize;
+    uint32_t compressedSize;
+    uint32_t zero;
+    uint32_t block1count;
+    uint32_t ddsHeaderBlockCount;
+};
+struct SdfTocId
+{
+    uint64_t ubisoft;
+    uint8_t data[0x20];
+    uint64_t massive;
+};
+struct SdfDdsHeader
+{
+    uint32_t usedBytes;
+    uint8_t bytes[0x94];
+};
+
+#pragma pack(pop)
+
+
+
+struct FileTree
+{
+    template <typename Callback>
+    static void ParseNames(File data, const Callback &cb, std::string name="")
+    {
+
+        auto readVariadicInteger = [&data](uint32_t count)
+        {
+            uint64_t result = 0;
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                result |= uint64_t(data.Read<uint8_t>()) << (i * 8);
+            }
+            return result;
+        };
+        auto ch = data.Read<char>();
+        if (ch == 0)
+            throw std::runtime_error("Unexcepted byte in file tree");
+        if (ch >= 1 && ch <= 0x1f) //string part
+        {
+            while (ch--)
+            {
+                name += data.Read<char>();
+            }
+            ParseNames(data, cb, name);
+        }
+        else if (ch >= 'A' && ch <= 'Z') //file entry
+        {
+
+            ch = ch - 'A';
+            auto count1 = ch & 7;
+            auto flag1 = (ch >> 3) & 1;
+
+            if (count1)
+            {
+                uint32_t strangeId = data.Read<uint32_t>();
+                auto ch2 = data.Read<uint8_t>();
+                auto byteCount = ch2 & 3;
+                auto byteValue = ch2 >> 2;
+                uint64_t ddsType = readVariadicInteger(byteCount);
+
+                for (int chunkIndex = 0;chunkIndex<count1;chunkIndex++)
+                {
+                    auto ch3 = data.Read<uint8_t>();
+                    auto compressedSizeByteCount = (ch3 & 3) + 1;
+                    auto packageOffsetByteCount = (ch3 >> 2) & 7;
+                    auto hasCompression = (ch3 >> 5) & 1;
+
+                    uint64_t decompressedSize = readVariadicInteger(compressedSizeByteCount);
+                    uint64_t compressedSize = 0;
+                    uint64_t packageOffset = 0;
+                    if (hasCompression)
+                    {
+                        compressedSize = readVariadicInteger(compressedSizeByteCount);
+                    }
+                    if (packageOffsetByteCount)
+                    {
+                        packageOffset = readVariadicInteger(packageOffsetByteCount);
+                    }
+                    uint64_t packageId = readVariadicInteger(2);
+
+                    std::vector<uint64_t> compSizeArray;
+
+                    if (hasCompression)
+                    {
+                        uint64_t pageCount = (decompressedSize + 0xffff) >> 16;
+                        if (pageCount > 1)
+                        {
+                            for (uint64_t page = 0; page < pageCount; page++)
+                            {
+                                uint64_t compSize = readVariadicInteger(2);
+                                compSizeArray.push_back(compSize);
+                            }
+                        }
+                    }
+
+                    uint64_t fileId = readVariadicInteger(4);
+
+                    if (compSizeArray.size() == 0 && hasCompression)
+                        compSizeArray.push_back(compressedSize);
+
+                    cb(name, packageId, packageOffset, decompressedSize, compSizeArray, ddsType, chunkIndex != 0, byteCount != 0 && chunkIndex == 0);
+
+                }
+
+            }
+            if (flag1)
+            {
+                auto ch3 = data.Read<uint8_t>();
+                while (ch3--)
+                {
+                    auto ch3_1 = data.Read<uint8_t>();
+                    auto ch3_2 = data.Read<uint8_t>();
+                }
+            }
+        }
+        else //search tree entry
+        {
+            File data2 = data;
+            uint32_t offset = data.Read<uint32_t>();
+            data2.Seek(offset);
+            ParseNames(data, cb, name);
+            ParseNames(data2, cb, name);
+        }
+    }
+};
+
+
+const uint64_t SdfPageSize = 0x10000;
+
+//inflated pages shared between readers, keyed by package block and compressed offset;
+//packages must stay alive while their pages are cached
+class PageCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<uint8_t>> Page;
+
+    PageCache(uint64_t capacity)
+        : capacity(capacity), used(0)
+    {
+    }
+    Page Find(const BlockBase *package, uint64_t offset)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = pages.find(Key(package, offset));
+        if (found == pages.end())
+            return Page();
+        lru.splice(lru.begin(), lru, found->second);
+        return found->second->second;
+    }
+    void Insert(const BlockBase *package, uint64_t offset, const Page &page)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Key key(package, offset);
+        if (pages.count(key) || page->size() > capacity)
+            return;
+        lru.emplace_front(key, page);
+        pages[key] = lru.begin();
+        used += page->size();
+        while (used > capacity)
+        {
+            used -= lru.back().second->size();
+            pages.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+private:
+    typedef std::pair<const BlockBase*, uint64_t> Key;
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            return std::hash<const void*>()(key.first) ^ (std::hash<uint64_t>()(key.second) * 31);
+        }
+    };
+    std::list<std::pair<Key, Page>> lru;
+    std::unordered_map<Key, std::list<std::pair<Key, Page>>::iterator, KeyHash> pages;
+    uint64_t capacity;
+    uint64_t used;
+    std::mutex mutex;
+};
+
+//calls cb(packageSize, decompressedSize) for every page of a compressed chunk, in package order.
+//A zero page size means the page is stored raw, so it occupies its decompressed size.
+template <typename Callback>
+void ForEachChunkPage(uint64_t decompressedSize, const std::vector<uint64_t> &compSizeArray, const Callback &cb)
+{
+    uint64_t decompOffset = 0;
+    for (uint64_t compSizePart : compSizeArray)
+    {
+        uint64_t decompSizePart = std::min(decompressedSize - decompOffset, SdfPageSize);
+        cb(compSizePart == 0 ? decompSizePart : compSizePart, decompSizePart);
+        decompOffset += decompSizePart;
+    }
+}
+
+//sdfdata chunk inflated lazily, only pages overlapping a read are decompressed
+class BlockCompressed : public BlockBase
+{
+public:
+    BlockCompressed(BlockPtr package, uint64_t packageOffset, uint64_t decompressedSize, const std::vector<uint64_t> &compSizeArray, PageCache *cache = nullptr)
+        : package(package)
+        , packageOffset(packageOffset)
+        , decompressedSize(decompressedSize)
+        , cache(cache)
+    {
+        //an empty chunk may still list the size of its empty zlib stream
+        uint64_t pageCount = (decompressedSize + SdfPageSize - 1) / SdfPageSize;
+        if (compSizeArray.size() != pageCount && !(decompressedSize == 0 && compSizeArray.size() == 1))
+            throw std::runtime_error("Page table does not match decompressed size");
+        pageOffsets.reserve(compSizeArray.size() + 1);
+        pageOffsets.push_back(0);
+        //pages whose package size equals their decompressed size are stored raw
+        ForEachChunkPage(decompressedSize, compSizeArray, [&](uint64_t packageSize, uint64_t)
+        {
+            pageOffsets.push_back(pageOffsets.back() + packageSize);
+        });
+    }
+    virtual void Read(void *data, size_t offset, size_t size) override
+    {
+        if (offset + size > decompressedSize)
+            throw std::runtime_error("Compressed block index out of range");
+        if (size == 0)
+            return;
+        size_t firstPage = size_t(offset / SdfPageSize);
+        size_t lastPage = size_t((offset + size - 1) / SdfPageSize);
+        //one read for every page in range
+        BlockView extent = package->View(size_t(packageOffset + pageOffsets[firstPage]), size_t(pageOffsets[lastPage + 1] - pageOffsets[firstPage]));
+        unsigned char *dst = static_cast<unsigned char*>(data);
+        std::unique_ptr<uint8_t[]> scratch;
+        for (size_t page = firstPage; page <= lastPage; page++)
+        {
+            uint64_t pageBegin = page * SdfPageSize;
+            uint64_t pageSize = std::min(decompressedSize - pageBegin, SdfPageSize);
+            uint64_t compSize = pageOffsets[page + 1] - pageOffsets[page];
+            const uint8_t *src = extent.Data() + (pageOffsets[page] - pageOffsets[firstPage]);
+            uint64_t copyBegin = std::max<uint64_t>(offset, pageBegin);
+            uint64_t copyEnd = std::min<uint64_t>(offset + size, pageBegin + pageSize);
+            if (compSize == pageSize)
+            {
+                std::memcpy(dst + (copyBegin - offset), src + (copyBegin - pageBegin), size_t(copyEnd - copyBegin));
+            }
+            else if (cache)
+            {
+                uint64_t pageOffset = packageOffset + pageOffsets[page];
+                PageCache::Page cached = cache->Find(package.get(), pageOffset);
+                if (!cached)
+                {
+                    auto inflated = std::make_shared<std::vector<uint8_t>>(size_t(pageSize));
+                    Inflate(inflated->data(), pageSize, src, compSize);
+                    cache->Insert(package.get(), pageOffset, inflated);
+                    cached = inflated;
+                }
+                std::memcpy(dst + (copyBegin - offset), cached->data() + (copyBegin - pageBegin), size_t(copyEnd - copyBegin));
+            }
+            else if (copyBegin == pageBegin && copyEnd == pageBegin + pageSize)
+            {
+                Inflate(dst + (pageBegin - offset), pageSize, src, compSize);
+            }
+            else
+            {
+                if (!scratch)
+                    scratch = std::make_unique<uint8_t[]>(size_t(SdfPageSize));
+                Inflate(scratch.get(), pageSize, src, compSize);
+                std::memcpy(dst + (copyBegin - offset), scratch.get() + (copyBegin - pageBegin), size_t(copyEnd - copyBegin));
+            }
+        }
+    }
+    virtual size_t Size() override
+    {
+        return size_t(decompressedSize);
+    }
+private:
+    static void Inflate(uint8_t *dst, uint64_t dstSize, const uint8_t *src, uint64_t srcSize)
+    {
+        uLong decompSize = uLong(dstSize);
+        if (uncompress(dst, &decompSize, src, uLong(srcSize)) != Z_OK)
+            throw std::runtime_error("Uncompress error");
+    }
+    BlockPtr package;
+    uint64_t packageOffset;
+    uint64_t decompressedSize;
+    std::vector<uint64_t> pageOffsets;
+    PageCache *cache;
+};
+
+BlockPtr MakeBlockCompressed(BlockPtr package, uint64_t packageOffset, uint64_t decompressedSize, const std::vector<uint64_t> &compSizeArray, PageCache *cache = nullptr)
+{
+    return BlockPtr(new BlockCompressed(package, packageOffset, decompressedSize, compSizeArray, cache));
+}
+
+
+struct SdfChunk
+{
+    uint64_t packageId;
+    uint64_t packageOffset;
+    uint64_t decompressedSize;
+    std::vector<uint64_t> compSizeArray;
+};
+
+//file entry with all its chunks, chunks are concatenated in order
+struct SdfEntry
+{
+    std::string name;
+    uint64_t ddsType;
+    bool useDDS;
+    std::vector<SdfChunk> chunks;
+};
+
+
+class SdfToc
+{
+public:
+    SdfToc(const PathString &sdfTocFile)
+        : sdfTocFile(sdfTocFile)
+        , tree(BlockPtr())
+        , treeReleased(false)
+    {
+        //keep the whole toc resident so arrays below are views into it
+        auto file = File(MakeBlockMemory(MakeBlockDisk(sdfTocFile)));
+
+        header = file.Read<SdfTocHeader>();
+        id = file.Read<SdfTocId>();
+        uint8_t signExistFlag = file.Read<uint8_t>();
+        if (signExistFlag)
+        {
+            file.Seek(0x140, FileOriginCurrent);
+        }
+
+        block1 = file.Array<uint32_t>(header.block1count);
+        block11 = file.Array<SdfTocId>(header.block1count);
+        ddsHeaderBlock = file.Array<SdfDdsHeader>(header.ddsHeaderBlockCount);
+
+        std::unique_ptr<uint8_t[]> decompressed = std::make_unique<uint8_t[]>(header.decompressedSize);
+        BlockView compressed = file.View(header.compressedSize);
+
+        uLong decompSize = header.decompressedSize;
+        uncompress(decompressed.get(), &decompSize, compressed.Data(), header.compressedSize);
+        tree = File(MakeBlockMemory(std::move(decompressed), decompSize));
+    }
+    template <typename Callback>
+    void ParseNames(const Callback &cb) const
+    {
+        if (treeReleased)
+            throw std::runtime_error("Toc tree was released");
+        FileTree::ParseNames(tree, cb);
+    }
+    //frees the name tree and the raw toc once entries live elsewhere; only the dds header
+    //table is copied out, PackagePath, DdsHeader and EntrySize keep working
+    void ReleaseTree()
+    {
+        std::vector<SdfDdsHeader> ddsHeaders(ddsHeaderBlock.Size());
+        for (size_t i = 0; i < ddsHeaders.size(); i++)
+        {
+            ddsHeaders[i] = ddsHeaderBlock[i];
+        }
+        ddsHeaderBlock = DataArray<SdfDdsHeader>(MakeBlockMemory(ddsHeaders), 0, ddsHeaders.size());
+        block1 = DataArray<uint32_t>();
+        block11 = DataArray<SdfTocId>();
+        tree = File(BlockPtr());
+        treeReleased = true;
+    }
+    //entries in toc order, continuation chunks folded into their entry
+    std::vector<SdfEntry> Entries() const
+    {
+        std::vector<SdfEntry> entries;
+        ParseNames([&](const std::string &name, uint64_t packageId, uint64_t packageOffset,
+            uint64_t decompressedSize, const std::vector<uint64_t> & compSizeArray,
+            uint64_t ddsType, bool append, bool useDDS)
+        {
+            if (!append || entries.empty())
+            {
+                entries.push_back(SdfEntry{ name, ddsType, useDDS, {} });
+            }
+            entries.back().chunks.push_back(SdfChunk{ packageId, packageOffset, decompressedSize, compSizeArray });
+        });
+        return entries;
+    }
+    PathString PackagePath(uint64_t packageId) const
+    {
+        boost::filesystem::path sdfTocPath(sdfTocFile);
+        PathString layer;
+        if (packageId < 1000)
+        {
+            layer = PATH_TEXT("A");
+        }
+        else if (packageId < 2000)
+        {
+            layer = PATH_TEXT("B");
+        }
+        else
+        {
+            layer = PATH_TEXT("C");
+        }
+        PathString dataFormated = boost::str(boost::basic_format<PathChar>(PATH_TEXT("-%s-%04i.sdfdata")) % layer % packageId);
+        return (sdfTocPath.parent_path() / sdfTocPath.stem()).native() + dataFormated;
+    }
+    //header block prepended to the first chunk of dds entries
+    BlockPtr DdsHeader(const SdfEntry &entry) const
+    {
+        SdfDdsHeader ddsHeader = ddsHeaderBlock[size_t(entry.ddsType)];
+        return MakeBlockMemory(ddsHeader.bytes, ddsHeader.usedBytes);
+    }
+    //extracted size as recorded in the toc
+    uint64_t EntrySize(const SdfEntry &entry) const
+    {
+        uint64_t size = entry.useDDS ? ddsHeaderBlock[size_t(entry.ddsType)].usedBytes : 0;
+        for (const SdfChunk &chunk : entry.chunks)
+        {
+            size += chunk.decompressedSize;
+        }
+        return size;
+    }
+
+    SdfTocHeader header;
+    SdfTocId id;
+    DataArray<uint32_t> block1;
+    DataArray<SdfTocId> block11;
+    DataArray<SdfDdsHeader> ddsHeaderBlock;
+private:
+    PathString sdfTocFile;
+    File tree;
+    bool treeReleased;
+};
+
+
+//extraction cost estimate: bytes read from the package plus bytes that go through inflate
+uint64_t EntryCost(const SdfEntry &entry)
+{
+    uint64_t cost = 0;
+    for (const SdfChunk &chunk : entry.chunks)
+    {
+        if (chunk.compSizeArray.empty())
+        {
+            cost += chunk.decompressedSize;
+            continue;
+        }
+        ForEachChunkPage(chunk.decompressedSize, chunk.compSizeArray, [&](uint64_t packageSize, uint64_t decompressedSize)
+        {
+            cost += packageSize == decompressedSize ? packageSize : packageSize + decompressedSize;
+        });
+    }
+    return cost;
+}
+
+//bytes a chunk occupies in its package
+uint64_t ChunkPackageSize(const SdfChunk &chunk)
+{
+    if (chunk.compSizeArray.empty())
+        return chunk.decompressedSize;
+    uint64_t size = 0;
+    ForEachChunkPage(chunk.decompressedSize, chunk.compSizeArray, [&](uint64_t packageSize, uint64_t)
+    {
+        size += packageSize;
+    });
+    return size;
+}
+
+//same sizes, page size arrays and dds header; package placement is ignored
+bool SameSignature(const SdfToc &oldToc, const SdfEntry &oldEntry, const SdfToc &newToc, const SdfEntry &newEntry)
+{
+    if (oldEntry.useDDS != newEntry.useDDS || oldEntry.chunks.size() != newEntry.chunks.size())
+        return false;
+    if (oldEntry.useDDS)
+    {
+        SdfDdsHeader oldHeader = oldToc.ddsHeaderBlock[size_t(oldEntry.ddsType)];
+        SdfDdsHeader newHeader = newToc.ddsHeaderBlock[size_t(newEntry.ddsType)];
+        if (std::memcmp(&oldHeader, &newHeader, sizeof(SdfDdsHeader)) != 0)
+            return false;
+    }
+    for (size_t i = 0; i < oldEntry.chunks.size(); i++)
+    {
+        if (oldEntry.chunks[i].decompressedSize != newEntry.chunks[i].decompressedSize
+            || oldEntry.chunks[i].compSizeArray != newEntry.chunks[i].compSizeArray)
+            return false;
+    }
+    return true;
+}
+
+//only multi-page page size arrays fingerprint the content, sizes alone don't
+bool AmbiguousSignature(const SdfEntry &entry)
+{
+    for (const SdfChunk &chunk : entry.chunks)
+    {
+        if (chunk.compSizeArray.size() < 2)
+            return true;
+    }
+    return false;
+}
+
+//crc32 and adler32 over the raw package bytes of every chunk; zero if a package is missing
+uint64_t EntryContentHash(const SdfToc &toc, const SdfEntry &entry)
+{
+    uLong crc = crc32(0, Z_NULL, 0);
+    uLong adler = adler32(0, Z_NULL, 0);
+    for (const SdfChunk &chunk : entry.chunks)
+    {
+        PathString sdfDataPath = toc.PackagePath(chunk.packageId);
+        if (!IsFileExist(sdfDataPath))
+            return 0;
+        BlockPtr package = MakeBlockPart(MakeBlockDisk(sdfDataPath), size_t(chunk.packageOffset), size_t(ChunkPackageSize(chunk)));
+        for (size_t offset = 0; offset < package->Size(); offset += WriteWindowSize)
+        {
+            size_t windowSize = std::min(WriteWindowSize, package->Size() - offset);
+            BlockView view = package->View(offset, windowSize);
+            crc = crc32(crc, view.Data(), uInt(windowSize));
+            adler = adler32(adler, view.Data(), uInt(windowSize));
+        }
+    }
+    return (uint64_t(crc) << 32) | (adler & 0xffffffff);
+}
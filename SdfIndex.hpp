@@ -0,0 +1,358 @@
+#pragma once
+#include "Sdf.hpp"
+#include <numeric>
+#include <cstring>
+
+
+//Compact, immutable entry table for long running tools.
+//Names are sorted and front coded in buckets of NameBucketSize: the first name of a bucket is
+//stored whole, the rest as (shared prefix length, suffix) against their predecessor, all in one
+//byte pool. Entry and chunk fields live in structure-of-arrays columns kept in toc order and
+//reached through rows, chunk and page ranges are delimited by begin arrays with one extra
+//trailing element.
+class SdfIndex
+{
+public:
+    static const size_t npos = size_t(-1);
+
+    SdfIndex(const SdfToc &toc)
+    {
+        //columns are filled in toc order straight from the parse; names only go to a flat scratch
+        //pool so sorting moves offsets around, not one string object per entry
+        std::vector<char> scratch;
+        std::vector<uint64_t> scratchBegin;
+        pageBegin.push_back(0);
+        toc.ParseNames([&](const std::string &name, uint64_t packageId, uint64_t packageOffset,
+            uint64_t decompressedSize, const std::vector<uint64_t> & compSizeArray,
+            uint64_t ddsType, bool append, bool useDDS)
+        {
+            if (!append || ddsTypes.empty())
+            {
+                scratchBegin.push_back(scratch.size());
+                scratch.insert(scratch.end(), name.begin(), name.end());
+                ddsTypes.push_back(uint32_t(ddsType) | (useDDS ? UseDdsFlag : 0));
+                chunkBegin.push_back(uint32_t(packageIds.size()));
+            }
+            packageIds.push_back(uint16_t(packageId));
+            packageOffsets.push_back(packageOffset);
+            decompressedSizes.push_back(uint32_t(decompressedSize));
+            for (uint64_t compSize : compSizeArray)
+            {
+                pageSizes.push_back(uint32_t(compSize));
+            }
+            pageBegin.push_back(uint32_t(pageSizes.size()));
+        });
+        scratchBegin.push_back(scratch.size());
+        chunkBegin.push_back(uint32_t(packageIds.size()));
+
+        //same ordering as std::string, bytes compare unsigned
+        auto compare = [&](uint32_t a, uint32_t b)
+        {
+            size_t sizeA = size_t(scratchBegin[a + 1] - scratchBegin[a]);
+            size_t sizeB = size_t(scratchBegin[b + 1] - scratchBegin[b]);
+            int result = std::memcmp(scratch.data() + scratchBegin[a], scratch.data() + scratchBegin[b], std::min(sizeA, sizeB));
+            return result != 0 ? result : sizeA < sizeB ? -1 : sizeA > sizeB ? 1 : 0;
+        };
+        //sorted by name, the last entry of a name wins like it does on disk
+        std::vector<uint32_t> order(ddsTypes.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+        {
+            return compare(a, b) < 0;
+        });
+
+        std::string name;
+        std::string previous;
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            if (i + 1 < order.size() && compare(order[i + 1], order[i]) == 0)
+                continue;
+            name.assign(scratch.data() + scratchBegin[order[i]], size_t(scratchBegin[order[i] + 1] - scratchBegin[order[i]]));
+            AppendName(name, previous);
+            rows.push_back(order[i]);
+            name.swap(previous);
+        }
+        namePool.shrink_to_fit();
+        bucketOffsets.shrink_to_fit();
+        rows.shrink_to_fit();
+        ddsTypes.shrink_to_fit();
+        chunkBegin.shrink_to_fit();
+        packageIds.shrink_to_fit();
+        packageOffsets.shrink_to_fit();
+        decompressedSizes.shrink_to_fit();
+        pageBegin.shrink_to_fit();
+        pageSizes.shrink_to_fit();
+    }
+    size_t Size() const
+    {
+        return rows.size();
+    }
+    //index of name or npos, binary search over bucket heads then a scan inside one bucket
+    size_t Find(const std::string &name) const
+    {
+        size_t index = LowerBound(name);
+        if (index < Size() && Name(index) == name)
+            return index;
+        return npos;
+    }
+    std::string Name(size_t index) const
+    {
+        Cursor cursor(*this, index / NameBucketSize);
+        while (cursor.Index() < index)
+        {
+            cursor.Next();
+        }
+        return cursor.Name();
+    }
+    SdfEntry Entry(size_t index) const
+    {
+        uint32_t row = rows[index];
+        SdfEntry entry;
+        entry.name = Name(index);
+        entry.ddsType = ddsTypes[row] & ~UseDdsFlag;
+        entry.useDDS = (ddsTypes[row] & UseDdsFlag) != 0;
+        for (uint32_t chunk = chunkBegin[row]; chunk < chunkBegin[row + 1]; chunk++)
+        {
+            entry.chunks.push_back(SdfChunk{ packageIds[chunk], packageOffsets[chunk], decompressedSizes[chunk],
+                std::vector<uint64_t>(pageSizes.begin() + pageBegin[chunk], pageSizes.begin() + pageBegin[chunk + 1]) });
+        }
+        return entry;
+    }
+    //calls cb(index, name) for every name starting with prefix, in sorted order
+    template <typename Callback>
+    void ForEachPrefix(const std::string &prefix, const Callback &cb) const
+    {
+        size_t index = LowerBound(prefix);
+        if (index >= Size())
+            return;
+        Cursor cursor(*this, index / NameBucketSize);
+        while (cursor.Index() < index)
+        {
+            cursor.Next();
+        }
+        for (;;)
+        {
+            if (cursor.Name().compare(0, prefix.size(), prefix) != 0)
+                break;
+            cb(cursor.Index(), cursor.Name());
+            if (cursor.Index() + 1 >= Size())
+                break;
+            cursor.Next();
+        }
+    }
+    //bytes held by the index
+    size_t MemoryUsage() const
+    {
+        return namePool.capacity() + bucketOffsets.capacity() * sizeof(uint64_t) + rows.capacity() * sizeof(uint32_t)
+            + ddsTypes.capacity() * sizeof(uint32_t) + chunkBegin.capacity() * sizeof(uint32_t)
+            + packageIds.capacity() * sizeof(uint16_t) + packageOffsets.capacity() * sizeof(uint64_t)
+            + decompressedSizes.capacity() * sizeof(uint32_t) + pageBegin.capacity() * sizeof(uint32_t)
+            + pageSizes.capacity() * sizeof(uint32_t);
+    }
+private:
+    static const size_t NameBucketSize = 16;
+    static const uint32_t UseDdsFlag = 0x80000000;
+
+    //sequential decoder over the name pool, starts at a bucket head
+    class Cursor
+    {
+    public:
+        Cursor(const SdfIndex &index, size_t bucket)
+            : pool(index.namePool.data())
+            , position(size_t(index.bucketOffsets[bucket]))
+            , index(bucket * NameBucketSize)
+        {
+            size_t length = ReadVarint();
+            name.assign(reinterpret_cast<const char*>(pool + position), length);
+            position += length;
+        }
+        //moves to the following name, crossing into the next bucket if needed
+        void Next()
+        {
+            index++;
+            size_t shared = index % NameBucketSize == 0 ? 0 : ReadVarint();
+            size_t length = ReadVarint();
+            name.resize(shared);
+            name.append(reinterpret_cast<const char*>(pool + position), length);
+            position += length;
+        }
+        size_t Index() const
+        {
+            return index;
+        }
+        const std::string &Name() const
+        {
+            return name;
+        }
+    private:
+        size_t ReadVarint()
+        {
+            size_t value = 0;
+            for (int shift = 0;; shift += 7)
+            {
+                uint8_t byte = pool[position++];
+                value |= size_t(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                    return value;
+            }
+        }
+        const uint8_t *pool;
+        size_t position;
+        size_t index;
+        std::string name;
+    };
+
+    void AppendName(const std::string &name, const std::string &previous)
+    {
+        if (Size() % NameBucketSize == 0)
+        {
+            bucketOffsets.push_back(namePool.size());
+            WriteVarint(name.size());
+            namePool.insert(namePool.end(), name.begin(), name.end());
+            return;
+        }
+        size_t shared = 0;
+        while (shared < name.size() && shared < previous.size() && name[shared] == previous[shared])
+        {
+            shared++;
+        }
+        WriteVarint(shared);
+        WriteVarint(name.size() - shared);
+        namePool.insert(namePool.end(), name.begin() + shared, name.end());
+    }
+    void WriteVarint(size_t value)
+    {
+        while (value >= 0x80)
+        {
+            namePool.push_back(uint8_t(value | 0x80));
+            value >>= 7;
+        }
+        namePool.push_back(uint8_t(value));
+    }
+    //first index whose name is not less than key
+    size_t LowerBound(const std::string &key) const
+    {
+        //last bucket whose head is below key, the answer is in it or at the next head
+        size_t low = 0;
+        size_t high = bucketOffsets.size();
+        while (low < high)
+        {
+            size_t middle = (low + high) / 2;
+            if (Cursor(*this, middle).Name() < key)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == 0)
+            return 0;
+        Cursor cursor(*this, low - 1);
+        size_t end = std::min(low * NameBucketSize, Size());
+        while (cursor.Name() < key)
+        {
+            if (cursor.Index() + 1 >= end)
+                return end;
+            cursor.Next();
+        }
+        return cursor.Index();
+    }
+
+    std::vector<uint8_t> namePool;
+    std::vector<uint64_t> bucketOffsets;
+    //toc row of every sorted name
+    std::vector<uint32_t> rows;
+    //per toc row
+    std::vector<uint32_t> ddsTypes;
+    std::vector<uint32_t> chunkBegin;
+    //per chunk
+    std::vector<uint16_t> packageIds;
+    std::vector<uint64_t> packageOffsets;
+    std::vector<uint32_t> decompressedSizes;
+    std::vector<uint32_t> pageBegin;
+    //page size array pool
+    std::vector<uint32_t> pageSizes;
+};
+
+
+//positions of shard out of count, balanced by EntryCost. Assignment only depends on toc
+//contents: entries are placed largest first on the least loaded shard, ties broken by position,
+//which is name order, and by shard index. The index already keeps one entry per name.
+std::vector<size_t> ShardEntries(const SdfIndex &index, const std::vector<size_t> &positions, unsigned shard, unsigned count)
+{
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(positions.size());
+    for (size_t position : positions)
+    {
+        order.emplace_back(EntryCost(index.Entry(position)), position);
+    }
+    std::sort(order.begin(), order.end(), [](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b)
+    {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    std::vector<uint64_t> loads(count, 0);
+    std::vector<size_t> result;
+    for (const auto &item : order)
+    {
+        unsigned target = unsigned(std::min_element(loads.begin(), loads.end()) - loads.begin());
+        loads[target] += item.first;
+        if (target == shard)
+            result.push_back(item.second);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+struct SdfDiff
+{
+    //positions in the new index
+    std::vector<size_t> added;
+    std::vector<size_t> changed;
+    std::vector<std::string> removed;
+};
+
+//entries are matched by name in one merge pass over both sorted indexes; each index already
+//holds only the last entry of a name, the one that ends up on disk
+SdfDiff DiffEntries(const SdfToc &oldToc, const SdfIndex &oldIndex, const SdfToc &newToc, const SdfIndex &newIndex, bool hashAmbiguous)
+{
+    SdfDiff diff;
+    size_t oldPosition = 0;
+    size_t newPosition = 0;
+    std::string oldName = oldIndex.Size() ? oldIndex.Name(0) : std::string();
+    std::string newName = newIndex.Size() ? newIndex.Name(0) : std::string();
+    while (oldPosition < oldIndex.Size() || newPosition < newIndex.Size())
+    {
+        int order = oldPosition == oldIndex.Size() ? 1
+            : newPosition == newIndex.Size() ? -1
+            : oldName.compare(newName);
+        if (order <= 0)
+        {
+            if (order < 0)
+            {
+                diff.removed.push_back(oldName);
+            }
+            else
+            {
+                SdfEntry oldEntry = oldIndex.Entry(oldPosition);
+                SdfEntry entry = newIndex.Entry(newPosition);
+                bool same = SameSignature(oldToc, oldEntry, newToc, entry);
+                if (same && hashAmbiguous && AmbiguousSignature(entry))
+                {
+                    uint64_t hash = EntryContentHash(newToc, entry);
+                    same = hash != 0 && hash == EntryContentHash(oldToc, oldEntry);
+                }
+                if (!same)
+                    diff.changed.push_back(newPosition);
+            }
+            if (++oldPosition < oldIndex.Size())
+                oldName = oldIndex.Name(oldPosition);
+        }
+        else
+        {
+            diff.added.push_back(newPosition);
+        }
+        if (order >= 0 && ++newPosition < newIndex.Size())
+            newName = newIndex.Name(newPosition);
+    }
+    return diff;
+}
@@ -0,0 +1,429 @@
+#pragma once
+#include "BasicFile.hpp"
+#include "utils.h"
+#include "Sdf.hpp"
+#include "MemoryBudget.hpp"
+#include "SdfIndex.hpp"
+#include <map>
+#include <thread>
+
+//Local extraction server protocol. Every message is a uint32 length followed by that many bytes.
+//Requests start with an SdfRequest byte, responses with an SdfStatus byte.
+//Strings are a uint32 length followed by the bytes, integers are little endian.
+//  list  <string prefix>                    -> uint32 count, count * (<string name> uint64 size)
+//  stat  <string name>                      -> uint64 size, uint32 chunkCount, uint8 useDDS
+//  read  <string name> uint64 offset, size  -> uint64 size, then size raw bytes outside the frame
+//Failed requests answer with a non-ok status and a string message.
+enum SdfRequest
+{
+    SdfRequestList = 1,
+    SdfRequestStat = 2,
+    SdfRequestRead = 3
+};
+
+enum SdfStatus
+{
+    SdfStatusOk = 0,
+    SdfStatusNotFound = 1,
+    SdfStatusBadRequest = 2,
+    SdfStatusError = 3
+};
+
+const uint32_t SdfMaxRequestSize = 0x10000;
+
+
+class SdfMessage
+{
+public:
+    template <typename T>
+    SdfMessage &Put(const T &value)
+    {
+        static_assert(std::is_trivial<T>::value, "Only trivial objects can be written");
+        const uint8_t *bytes = reinterpret_cast<const uint8_t*>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+        return *this;
+    }
+    SdfMessage &PutString(const std::string &value)
+    {
+        Put<uint32_t>(uint32_t(value.size()));
+        data.insert(data.end(), value.begin(), value.end());
+        return *this;
+    }
+    void Send(SocketHandle socket) const
+    {
+        uint32_t size = uint32_t(data.size());
+        SendAll(socket, &size, sizeof(size));
+        SendAll(socket, data.data(), data.size());
+    }
+private:
+    std::vector<uint8_t> data;
+};
+
+//reads one framed message into message, false if the peer closed the connection
+inline bool ReceiveMessage(SocketHandle socket, File &message, uint32_t maxSize)
+{
+    uint32_t size = 0;
+    if (!ReceiveAll(socket, &size, sizeof(size)))
+        return false;
+    if (size > maxSize)
+        throw std::runtime_error("Message too large");
+    std::unique_ptr<unsigned char[]> data = std::make_unique<unsigned char[]>(size);
+    if (size && !ReceiveAll(socket, data.get(), size))
+        throw std::runtime_error("Connection closed");
+    message = File(MakeBlockMemory(std::move(data), size));
+    return true;
+}
+
+inline std::string ReadString(File &message)
+{
+    uint32_t size = message.Read<uint32_t>();
+    BlockView view = message.View(size);
+    return std::string(reinterpret_cast<const char*>(view.Data()), size);
+}
+
+
+//resident index over one or more tocs, serves requests from concurrent connections
+class SdfServer
+{
+public:
+    SdfServer(const std::vector<PathString> &tocFiles, uint64_t cacheSize, uint64_t maxMemory)
+        : cache(cacheSize)
+        , budget(maxMemory)
+    {
+        for (const PathString &tocFile : tocFiles)
+        {
+            tocs.emplace_back(new SdfToc(tocFile));
+            indexes.emplace_back(new SdfIndex(*tocs.back()));
+            //the index holds every entry now, keep only package paths and dds headers
+            tocs.back()->ReleaseTree();
+        }
+    }
+    void Run(const PathString &socketPath)
+    {
+        SocketHandle listener = ListenLocalSocket(socketPath);
+        size_t entryCount = 0;
+        size_t indexSize = 0;
+        for (const auto &index : indexes)
+        {
+            entryCount += index->Size();
+            indexSize += index->MemoryUsage();
+        }
+        std::cout << "Serving " << entryCount << " entries (" << indexSize << " bytes of index) on " << NarrowPath(socketPath) << std::endl;
+        try
+        {
+            for (;;)
+            {
+                SocketHandle client = AcceptLocalSocket(listener);
+                std::lock_guard<std::mutex> lock(connectionsMutex);
+                JoinFinished();
+                std::thread &thread = connections[client];
+                try
+                {
+                    thread = std::thread(&SdfServer::Serve, this, client);
+                }
+                catch (const std::system_error &)
+                {
+                    //no thread to spare, drop this connection and keep serving
+                    connections.erase(client);
+                    CloseSocket(client);
+                }
+            }
+        }
+        catch (...)
+        {
+            CloseSocket(listener);
+            StopConnections();
+            throw;
+        }
+    }
+private:
+    struct ServerEntry
+    {
+        size_t toc;
+        SdfEntry entry;
+    };
+
+    void Serve(SocketHandle client)
+    {
+        try
+        {
+            File request(BlockPtr{});
+            while (ReceiveMessage(client, request, SdfMaxRequestSize))
+            {
+                Handle(client, request);
+            }
+        }
+        catch (const std::exception &)
+        {
+            //broken connection or a failure mid-stream, drop the client
+        }
+        {
+            //hand our own thread over for joining, unless StopConnections already took it
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            auto found = connections.find(client);
+            if (found != connections.end())
+            {
+                finished.push_back(std::move(found->second));
+                connections.erase(found);
+            }
+        }
+        CloseSocket(client);
+    }
+    //joins connection threads that have already returned, called under connectionsMutex
+    void JoinFinished()
+    {
+        for (std::thread &thread : finished)
+        {
+            thread.join();
+        }
+        finished.clear();
+    }
+    //wakes every open connection and waits for all connection threads to end
+    void StopConnections()
+    {
+        std::vector<std::thread> running;
+        {
+            std::lock_guard<std::mutex> lock(connectionsMutex);
+            for (auto &connection : connections)
+            {
+                ShutdownSocket(connection.first);
+                running.push_back(std::move(connection.second));
+            }
+            connections.clear();
+            for (std::thread &thread : finished)
+            {
+                running.push_back(std::move(thread));
+            }
+            finished.clear();
+        }
+        for (std::thread &thread : running)
+        {
+            thread.join();
+        }
+    }
+    void Handle(SocketHandle client, File &request)
+    {
+        uint8_t type = 0;
+        std::string name;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        try
+        {
+            type = request.Read<uint8_t>();
+            name = ReadString(request);
+            if (type == SdfRequestRead)
+            {
+                offset = request.Read<uint64_t>();
+                size = request.Read<uint64_t>();
+            }
+        }
+        catch (const std::exception &)
+        {
+            SdfMessage().Put<uint8_t>(SdfStatusBadRequest).PutString("Malformed request").Send(client);
+            return;
+        }
+
+        if (type == SdfRequestList)
+        {
+            SdfMessage response;
+            std::vector<std::pair<std::string, uint64_t>> found;
+            for (size_t tocIndex = 0; tocIndex < indexes.size(); tocIndex++)
+            {
+                indexes[tocIndex]->ForEachPrefix(name, [&](size_t index, const std::string &entryName)
+                {
+                    if (Owner(entryName) == tocIndex)
+                        found.emplace_back(entryName, tocs[tocIndex]->EntrySize(indexes[tocIndex]->Entry(index)));
+                });
+            }
+            if (indexes.size() > 1)
+                std::sort(found.begin(), found.end());
+            response.Put<uint8_t>(SdfStatusOk).Put<uint32_t>(uint32_t(found.size()));
+            for (const auto &entry : found)
+            {
+                response.PutString(entry.first).Put<uint64_t>(entry.second);
+            }
+            response.Send(client);
+            return;
+        }
+        if (type != SdfRequestStat && type != SdfRequestRead)
+        {
+            SdfMessage().Put<uint8_t>(SdfStatusBadRequest).PutString("Unknown request").Send(client);
+            return;
+        }
+
+        ServerEntry found;
+        BlockPtr block;
+        try
+        {
+            found.toc = Owner(name);
+            if (found.toc != SdfIndex::npos)
+            {
+                found.entry = indexes[found.toc]->Entry(indexes[found.toc]->Find(name));
+                block = OpenEntry(found);
+            }
+        }
+        catch (const std::exception &ex)
+        {
+            SdfMessage().Put<uint8_t>(SdfStatusError).PutString(ex.what()).Send(client);
+            return;
+        }
+        if (!block)
+        {
+            SdfMessage().Put<uint8_t>(SdfStatusNotFound).PutString("No such entry").Send(client);
+            return;
+        }
+
+        if (type == SdfRequestStat)
+        {
+            const SdfEntry &entry = found.entry;
+            SdfMessage().Put<uint8_t>(SdfStatusOk).Put<uint64_t>(block->Size())
+                .Put<uint32_t>(uint32_t(entry.chunks.size())).Put<uint8_t>(entry.useDDS).Send(client);
+            return;
+        }
+
+        if (offset > block->Size())
+        {
+            SdfMessage().Put<uint8_t>(SdfStatusBadRequest).PutString("Offset beyond end of entry").Send(client);
+            return;
+        }
+        size = std::min<uint64_t>(size, block->Size() - offset);
+        SdfMessage().Put<uint8_t>(SdfStatusOk).Put<uint64_t>(size).Send(client);
+
+        //stream the range window by window, failures past this point close the connection
+        MemoryReservation reservation(budget, 2 * std::min<uint64_t>(size, WriteWindowSize));
+        std::unique_ptr<char[]> buffer;
+        for (uint64_t position = 0; position < size; position += WriteWindowSize)
+        {
+            size_t windowSize = size_t(std::min<uint64_t>(WriteWindowSize, size - position));
+            if (const void *mapped = block->Map(size_t(offset + position), windowSize))
+            {
+                SendAll(client, mapped, windowSize);
+                continue;
+            }
+            if (!buffer)
+                buffer = std::make_unique<char[]>(size_t(std::min<uint64_t>(WriteWindowSize, size)));
+            block->Read(buffer.get(), size_t(offset + position), windowSize);
+            SendAll(client, buffer.get(), windowSize);
+        }
+    }
+    //whole entry as one block, same layout the extractor writes; null if no package is present
+    BlockPtr OpenEntry(const ServerEntry &serverEntry)
+    {
+        const SdfToc &toc = *tocs[serverEntry.toc];
+        const SdfEntry &entry = serverEntry.entry;
+        BlockPtr result;
+        for (size_t chunkIndex = 0; chunkIndex < entry.chunks.size(); chunkIndex++)
+        {
+            const SdfChunk &chunk = entry.chunks[chunkIndex];
+            BlockPtr package = Package(serverEntry.toc, chunk.packageId);
+            if (!package)
+                continue;
+            BlockPtr chunkBlock;
+            if (chunk.compSizeArray.size() == 0)
+                chunkBlock = MakeBlockPart(package, size_t(chunk.packageOffset), size_t(chunk.decompressedSize));
+            else
+                chunkBlock = MakeBlockCompressed(package, chunk.packageOffset, chunk.decompressedSize, chunk.compSizeArray, &cache);
+            if (entry.useDDS && chunkIndex == 0)
+                chunkBlock = MakeBlockPair(toc.DdsHeader(entry), chunkBlock);
+            result = result ? MakeBlockPair(result, chunkBlock) : chunkBlock;
+        }
+        return result;
+    }
+    //toc that serves name, earlier tocs win on duplicate names; npos if none has it
+    size_t Owner(const std::string &name) const
+    {
+        for (size_t tocIndex = 0; tocIndex < indexes.size(); tocIndex++)
+        {
+            if (indexes[tocIndex]->Find(name) != SdfIndex::npos)
+                return tocIndex;
+        }
+        return SdfIndex::npos;
+    }
+    //packages are mapped on first use and stay resident
+    BlockPtr Package(size_t tocIndex, uint64_t packageId)
+    {
+        std::lock_guard<std::mutex> lock(packagesMutex);
+        auto key = std::make_pair(tocIndex, packageId);
+        auto found = packages.find(key);
+        if (found != packages.end())
+            return found->second;
+        PathString sdfDataPath = tocs[tocIndex]->PackagePath(packageId);
+        BlockPtr package = IsFileExist(sdfDataPath) ? MakeBlockMapped(sdfDataPath) : BlockPtr();
+        packages[key] = package;
+        return package;
+    }
+
+    std::vector<std::unique_ptr<SdfToc>> tocs;
+    std::vector<std::unique_ptr<SdfIndex>> indexes;
+    std::map<std::pair<size_t, uint64_t>, BlockPtr> packages;
+    std::mutex packagesMutex;
+    //connection threads never outlive Run, finished ones are joined on the next accept
+    std::map<SocketHandle, std::thread> connections;
+    std::vector<std::thread> finished;
+    std::mutex connectionsMutex;
+    PageCache cache;
+    MemoryBudget budget;
+};
+
+
+//thin client for SdfServer, one connection per instance
+class SdfClient
+{
+public:
+    SdfClient(const PathString &socketPath)
+        : connection(ConnectLocalSocket(socketPath))
+    {
+    }
+    SdfClient(const SdfClient &) = delete;
+    SdfClient &operator=(const SdfClient &) = delete;
+    ~SdfClient()
+    {
+        CloseSocket(connection);
+    }
+    std::vector<std::pair<std::string, uint64_t>> List(const std::string &prefix)
+    {
+        SdfMessage().Put<uint8_t>(SdfRequestList).PutString(prefix).Send(connection);
+        File response = Response();
+        std::vector<std::pair<std::string, uint64_t>> result(response.Read<uint32_t>());
+        for (auto &entry : result)
+        {
+            entry.first = ReadString(response);
+            entry.second = response.Read<uint64_t>();
+        }
+        return result;
+    }
+    uint64_t Stat(const std::string &name)
+    {
+        SdfMessage().Put<uint8_t>(SdfRequestStat).PutString(name).Send(connection);
+        return Response().Read<uint64_t>();
+    }
+    //writes the range to stream, returns the number of bytes received
+    uint64_t Read(const std::string &name, uint64_t offset, uint64_t size, std::ostream &stream)
+    {
+        SdfMessage().Put<uint8_t>(SdfRequestRead).PutString(name).Put<uint64_t>(offset).Put<uint64_t>(size).Send(connection);
+        uint64_t received = Response().Read<uint64_t>();
+        std::unique_ptr<char[]> buffer = std::make_unique<char[]>(WriteWindowSize);
+        for (uint64_t position = 0; position < received; position += WriteWindowSize)
+        {
+            size_t windowSize = size_t(std::min<uint64_t>(WriteWindowSize, received - position));
+            if (!ReceiveAll(connection, buffer.get(), windowSize))
+                throw std::runtime_error("Connection closed");
+            stream.write(buffer.get(), windowSize);
+        }
+        if (!stream.good())
+            throw std::runtime_error("File write error");
+        return received;
+    }
+private:
+    File Response()
+    {
+        File response(BlockPtr{});
+        if (!ReceiveMessage(connection, response, UINT32_MAX))
+            throw std::runtime_error("Connection closed");
+        uint8_t status = response.Read<uint8_t>();
+        if (status != SdfStatusOk)
+            throw std::runtime_error(ReadString(response));
+        return response;
+    }
+    SocketHandle connection;
+};
@@ -1,281 +1,350 @@
 #include "BasicFile.hpp"
 #include "utils.h"
-#include <zlib.h>
-#include <boost\filesystem.hpp>
-#include <boost\format.hpp>
-
-#pragma pack(push,1)
-struct SdfTocHeader
-{
-    uint32_t fileTag; //0x54534557
-    uint32_t fileVersion;
-    uint32_t decompressedSize;
-    uint32_t compressedSize;
-    uint32_t zero;
-    uint32_t block1count;
-    uint32_t ddsHeaderBlockCount;
-};
-struct SdfTocId
+#include "Sdf.hpp"
+#include "MemoryBudget.hpp"
+#include "SdfServer.hpp"
+#include "SdfIndex.hpp"
+#include <boost/filesystem.hpp>
+#include <thread>
+#include <mutex>
+#include <exception>
+
+
+//bytes held by one entry while streaming: output window, compressed window and read buffer
+uint64_t EntryMemoryCost(const SdfEntry &entry)
 {
-    uint64_t ubisoft;
-    uint8_t data[0x20];
-    uint64_t massive;
-};
-struct SdfDdsHeader
-{
-    uint32_t usedBytes;
-    uint8_t bytes[0x94];
-};
-
-#pragma pack(pop)
-
-
+    uint64_t largestChunk = 0;
+    for (const SdfChunk &chunk : entry.chunks)
+    {
+        largestChunk = std::max(largestChunk, chunk.decompressedSize);
+    }
+    return 3 * std::min<uint64_t>(largestChunk + SdfPageSize, WriteWindowSize + SdfPageSize);
+}
 
-struct FileTree
+//stored chunk copied package to output inside the kernel (reflink or copy_file_range),
+//whatever the kernel can't copy goes through one user space window
+void CopyStoredChunk(const PathString &sdfDataPath, const SdfChunk &chunk, BlockPtr prefix, const PathString &outFileName, bool append)
 {
-    template <typename Callback>
-    static void ParseNames(File data, const Callback &cb, std::string name="")
+    FileHandle source = OpenFileRead(sdfDataPath);
+    FileHandle target;
+    try
     {
-
-        auto readVariadicInteger = [&data](uint32_t count)
-        {
-            uint64_t result = 0;
-
-            for (uint32_t i = 0; i < count; i++)
-            {
-                result |= uint64_t(data.Read<uint8_t>()) << (i * 8);
-            }
-            return result;
-        };
-        auto ch = data.Read<char>();
-        if (ch == 0)
-            throw std::exception("Unexcepted byte in file tree");
-        if (ch >= 1 && ch <= 0x1f) //string part
+        target = OpenFileWrite(outFileName, append);
+    }
+    catch (...)
+    {
+        CloseFile(source);
+        throw;
+    }
+    try
+    {
+        if (chunk.packageOffset + chunk.decompressedSize > FileSize(source))
+            throw std::runtime_error("Going beyond file");
+        uint64_t targetOffset = append ? FileSize(target) : 0;
+        if (prefix)
         {
-            while (ch--)
-            {
-                name += data.Read<char>();
-            }
-            ParseNames(data, cb, name);
+            BlockView view = prefix->View(0, prefix->Size());
+            WriteFileAt(target, view.Data(), targetOffset, view.Size());
+            targetOffset += view.Size();
         }
-        else if (ch >= 'A' && ch <= 'Z') //file entry
+        uint64_t copied = CopyFileRange(source, chunk.packageOffset, target, targetOffset, chunk.decompressedSize);
+        std::unique_ptr<unsigned char[]> buffer;
+        while (copied < chunk.decompressedSize)
         {
+            size_t windowSize = size_t(std::min<uint64_t>(WriteWindowSize, chunk.decompressedSize - copied));
+            if (!buffer)
+                buffer = std::make_unique<unsigned char[]>(windowSize);
+            ReadFileAt(source, buffer.get(), chunk.packageOffset + copied, windowSize);
+            WriteFileAt(target, buffer.get(), targetOffset + copied, windowSize);
+            copied += windowSize;
+        }
+    }
+    catch (...)
+    {
+        CloseFile(target);
+        CloseFile(source);
+        throw;
+    }
+    CloseFile(target);
+    CloseFile(source);
+}
 
-            ch = ch - 'A';
-            auto count1 = ch & 7;
-            auto flag1 = (ch >> 3) & 1;
+void ExtractEntry(const SdfToc &toc, const SdfEntry &entry, const PathString &outputDir, bool directIo)
+{
+    PathString outFileName = outputDir + NativePath(entry.name);
+    std::replace(outFileName.begin(), outFileName.end(), PATH_TEXT('/'), PathSeparator);
 
-            if (count1)
-            {
-                uint32_t strangeId = data.Read<uint32_t>();
-                auto ch2 = data.Read<uint8_t>();
-                auto byteCount = ch2 & 3;
-                auto byteValue = ch2 >> 2;
-                uint64_t ddsType = readVariadicInteger(byteCount);
+    for (size_t chunkIndex = 0; chunkIndex < entry.chunks.size(); chunkIndex++)
+    {
+        const SdfChunk &chunk = entry.chunks[chunkIndex];
+        PathString sdfDataPath = toc.PackagePath(chunk.packageId);
 
-                for (int chunkIndex = 0;chunkIndex<count1;chunkIndex++)
-                {
-                    auto ch3 = data.Read<uint8_t>();
-                    auto compressedSizeByteCount = (ch3 & 3) + 1;
-                    auto packageOffsetByteCount = (ch3 >> 2) & 7;
-                    auto hasCompression = (ch3 >> 5) & 1;
+        if (!IsFileExist(sdfDataPath))
+            continue;
 
-                    uint64_t decompressedSize = readVariadicInteger(compressedSizeByteCount);
-                    uint64_t compressedSize = 0;
-                    uint64_t packageOffset = 0;
-                    if (hasCompression)
-                    {
-                        compressedSize = readVariadicInteger(compressedSizeByteCount);
-                    }
-                    if (packageOffsetByteCount)
-                    {
-                        packageOffset = readVariadicInteger(packageOffsetByteCount);
-                    }
-                    uint64_t packageId = readVariadicInteger(2);
+        //direct io keeps stored chunks on the block path so they stay out of the page cache
+        if (chunk.compSizeArray.size() == 0 && !directIo)
+        {
+            CreateDirectoryRecursively(ExtractFilePath(outFileName));
+            BlockPtr prefix = entry.useDDS && chunkIndex == 0 ? toc.DdsHeader(entry) : BlockPtr();
+            CopyStoredChunk(sdfDataPath, chunk, prefix, outFileName, chunkIndex != 0);
+            continue;
+        }
 
-                    std::vector<uint64_t> compSizeArray;
+        BlockPtr fileBlock = directIo ? MakeBlockDiskDirect(sdfDataPath) : MakeBlockDisk(sdfDataPath);
 
-                    if (hasCompression)
-                    {
-                        uint64_t pageCount = (decompressedSize + 0xffff) >> 16;
-                        if (pageCount > 1)
-                        {
-                            for (uint64_t page = 0; page < pageCount; page++)
-                            {
-                                uint64_t compSize = readVariadicInteger(2);
-                                compSizeArray.push_back(compSize);
-                            }
-                        }
-                    }
+        CreateDirectoryRecursively(ExtractFilePath(outFileName));
 
-                    uint64_t fileId = readVariadicInteger(4);
+        BlockPtr resultBlock;
 
-                    if (compSizeArray.size() == 0 && hasCompression)
-                        compSizeArray.push_back(compressedSize);
-
-                    cb(name, packageId, packageOffset, decompressedSize, compSizeArray, ddsType, chunkIndex != 0, byteCount != 0 && chunkIndex == 0);
+        if (chunk.compSizeArray.size() == 0)
+        {
+            //decompressed
+            resultBlock = MakeBlockPart(fileBlock, chunk.packageOffset, chunk.decompressedSize);
+        }
+        else
+        {
+            resultBlock = MakeBlockCompressed(fileBlock, chunk.packageOffset, chunk.decompressedSize, chunk.compSizeArray);
+        }
 
-                }
+        if (entry.useDDS && chunkIndex == 0)
+        {
+            resultBlock = MakeBlockPair(toc.DdsHeader(entry), resultBlock);
+        }
 
-            }
-            if (flag1)
-            {
-                auto ch3 = data.Read<uint8_t>();
-                while (ch3--)
-                {
-                    auto ch3_1 = data.Read<uint8_t>();
-                    auto ch3_2 = data.Read<uint8_t>();
-                }
-            }
+        if (chunkIndex != 0)
+        {
+            WriteBlockApp(resultBlock, outFileName);
         }
-        else //search tree entry
+        else
         {
-            File data2 = data;
-            uint32_t offset = data.Read<uint32_t>();
-            data2.Seek(offset);
-            ParseNames(data, cb, name);
-            ParseNames(data2, cb, name);
+            WriteBlock(resultBlock, outFileName);
         }
     }
-};
+}
+
+//accepts plain bytes or a K/M/G suffix
+uint64_t ParseByteSize(const PathString &text)
+{
+    size_t end = 0;
+    uint64_t value = std::stoull(text, &end);
+    PathString suffix = text.substr(end);
+    if (suffix == PATH_TEXT("K") || suffix == PATH_TEXT("k"))
+        value <<= 10;
+    else if (suffix == PATH_TEXT("M") || suffix == PATH_TEXT("m"))
+        value <<= 20;
+    else if (suffix == PATH_TEXT("G") || suffix == PATH_TEXT("g"))
+        value <<= 30;
+    else if (!suffix.empty())
+        throw std::runtime_error("Invalid size suffix");
+    return value;
+}
+
+
+int RunClient(const PathString &socketPath, const std::vector<PathString> &args)
+{
+    SdfClient client(socketPath);
+    const PathString &command = args[0];
+    if (command == PATH_TEXT("list") && args.size() <= 2)
+    {
+        for (const auto &entry : client.List(args.size() == 2 ? NarrowPath(args[1]) : ""))
+        {
+            std::cout << entry.first << " " << entry.second << std::endl;
+        }
+    }
+    else if (command == PATH_TEXT("stat") && args.size() == 2)
+    {
+        std::cout << client.Stat(NarrowPath(args[1])) << std::endl;
+    }
+    else if (command == PATH_TEXT("read") && (args.size() == 3 || args.size() == 5))
+    {
+        uint64_t offset = args.size() == 5 ? std::stoull(args[3]) : 0;
+        uint64_t size = args.size() == 5 ? std::stoull(args[4]) : UINT64_MAX;
+        CreateDirectoryRecursively(ExtractFilePath(args[2]));
+        std::ofstream file(args[2], std::ios::binary);
+        client.Read(NarrowPath(args[1]), offset, size, file);
+    }
+    else
+    {
+        throw std::runtime_error("Unknown client command");
+    }
+    return 0;
+}
 
 
+#ifdef _WIN32
 int wmain(int argc, wchar_t* argv[])
+#else
+int main(int argc, char* argv[])
+#endif
 {
-    if (argc != 3)
+    std::vector<PathString> args;
+    bool directIo = false;
+    uint64_t maxMemory = 0;
+    uint64_t cacheSize = 256ull << 20;
+    unsigned jobs = 1;
+    PathString diffAgainst;
+    bool diffHash = false;
+    unsigned shardIndex = 0;
+    unsigned shardCount = 1;
+    PathString serveSocket;
+    PathString clientSocket;
+    try
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            PathString arg = argv[i];
+            if (arg == PATH_TEXT("--direct-io"))
+                directIo = true;
+            else if (arg == PATH_TEXT("--max-memory") && i + 1 < argc)
+                maxMemory = ParseByteSize(argv[++i]);
+            else if (arg == PATH_TEXT("--jobs") && i + 1 < argc)
+                jobs = std::max(1, std::stoi(argv[++i]));
+            else if (arg == PATH_TEXT("--serve") && i + 1 < argc)
+                serveSocket = argv[++i];
+            else if (arg == PATH_TEXT("--client") && i + 1 < argc)
+                clientSocket = argv[++i];
+            else if (arg == PATH_TEXT("--cache-size") && i + 1 < argc)
+                cacheSize = ParseByteSize(argv[++i]);
+            else if (arg == PATH_TEXT("--diff-against") && i + 1 < argc)
+                diffAgainst = argv[++i];
+            else if (arg == PATH_TEXT("--diff-hash"))
+                diffHash = true;
+            else if (arg == PATH_TEXT("--shard") && i + 1 < argc)
+            {
+                PathString shard = argv[++i];
+                size_t slash = shard.find(PATH_TEXT('/'));
+                if (slash == PathString::npos)
+                    throw std::runtime_error("Invalid shard");
+                shardIndex = std::stoul(shard.substr(0, slash));
+                shardCount = std::stoul(shard.substr(slash + 1));
+                if (shardCount == 0 || shardIndex >= shardCount)
+                    throw std::runtime_error("Invalid shard");
+            }
+            else
+                args.push_back(arg);
+        }
+    }
+    catch (const std::exception &)
+    {
+        args.clear();
+    }
+    bool validArgs = !serveSocket.empty() ? args.size() >= 1 && clientSocket.empty()
+        : !clientSocket.empty() ? args.size() >= 1
+        : args.size() == 2;
+    if (!validArgs)
     {
         std::cout << "Tom Clancy's The Division .sdftoc extractor v2" << std::endl;
-        std::cout << "usage: rouge_sdf.exe <.sdftoc path> <output directory>" << std::endl;
+        std::cout << "usage: rouge_sdf.exe [options] <.sdftoc path> <output directory>" << std::endl;
+        std::cout << "       rouge_sdf.exe --serve <socket path> [options] <.sdftoc path>..." << std::endl;
+        std::cout << "       rouge_sdf.exe --client <socket path> list [prefix] | stat <name> | read <name> <output file> [offset size]" << std::endl;
+        std::cout << "  --direct-io         read .sdfdata bypassing the OS file cache" << std::endl;
+        std::cout << "  --jobs <n>          extract n entries in parallel" << std::endl;
+        std::cout << "  --max-memory <size> cap memory held by in-flight entries, e.g. 256M" << std::endl;
+        std::cout << "  --cache-size <size> inflated pages kept by the server, default 256M" << std::endl;
+        std::cout << "  --diff-against <old .sdftoc> extract only entries added or changed since the old toc" << std::endl;
+        std::cout << "  --diff-hash         confirm entries with a weak size signature by hashing package bytes" << std::endl;
+        std::cout << "  --shard <i>/<n>     extract only shard i of n (0 based), shards union to the full tree" << std::endl;
         return 0;
     }
     try
     {
-
-        std::wstring sdfTocFile = argv[1];
-        std::wstring outputDir = argv[2];
-
-        outputDir = boost::filesystem::path(outputDir).remove_trailing_separator().wstring() + L"\\";
-
-        auto file = MakeFileDisk(sdfTocFile);
-
-
-        SdfTocHeader header = file.Read<SdfTocHeader>();
-        SdfTocId id = file.Read<SdfTocId>();
-        uint8_t signExistFlag = file.Read<uint8_t>();
-        if (signExistFlag)
+        if (!clientSocket.empty())
+        {
+            return RunClient(clientSocket, args);
+        }
+        if (!serveSocket.empty())
         {
-            file.Seek(0x140, FileOriginCurrent);
+            SdfServer server(args, cacheSize, maxMemory);
+            server.Run(serveSocket);
+            return 0;
         }
 
-        auto block1 = file.Array<uint32_t>(header.block1count);;
-        auto block11 = file.Array<SdfTocId>(header.block1count);;
-        auto ddsHeaderBlock = file.Array<SdfDdsHeader>(header.ddsHeaderBlockCount);
 
+        PathString sdfTocFile = args[0];
+        PathString outputDir = args[1];
 
-        std::unique_ptr<uint8_t[]> decompressed = std::make_unique<uint8_t[]>(header.decompressedSize);
-        std::unique_ptr<uint8_t[]> compressed = std::make_unique<uint8_t[]>(header.compressedSize);
+        outputDir = boost::filesystem::path(outputDir).remove_trailing_separator().native() + PathSeparator;
 
-        file.Read<uint8_t>(compressed.get(), header.compressedSize);
-        uLong decompSize = header.decompressedSize;
-        uncompress(decompressed.get(), &decompSize, compressed.get(), header.compressedSize);
-        File f = File(MakeBlockMemory(std::move(decompressed), decompSize));
-        FileTree::ParseNames(f, [&](const std::string &name, uint64_t packageId, uint64_t packageOffset,
-            uint64_t decompressedSize, const std::vector<uint64_t> & compSizeArray,
-            uint64_t ddsType, bool append, bool useDDS)
+        //entries stay in the compact index, a full SdfEntry only exists per work item;
+        //the index keeps one entry per name, so no two workers write the same file
+        SdfToc toc(sdfTocFile);
+        SdfIndex index(toc);
+        toc.ReleaseTree();
+        std::vector<size_t> positions(index.Size());
+        std::iota(positions.begin(), positions.end(), 0);
+        if (!diffAgainst.empty())
         {
-
-
-            std::cout << name << std::endl;
-
-            boost::filesystem::path sdfTocPath(sdfTocFile);
-            std::wstring layer;
-            if (packageId < 1000)
+            SdfToc oldToc(diffAgainst);
+            SdfIndex oldIndex(oldToc);
+            oldToc.ReleaseTree();
+            SdfDiff diff = DiffEntries(oldToc, oldIndex, toc, index, diffHash);
+            for (size_t position : diff.added)
             {
-                layer = L"A";
+                std::cout << "A " << index.Name(position) << std::endl;
             }
-            else if (packageId < 2000)
+            for (size_t position : diff.changed)
             {
-                layer = L"B";
+                std::cout << "M " << index.Name(position) << std::endl;
             }
-            else
+            for (const std::string &name : diff.removed)
             {
-                layer = L"C";
+                std::cout << "D " << name << std::endl;
             }
-            typedef  boost::basic_format<wchar_t >  wformat;
-            std::wstring dataFormated = boost::str(boost::wformat(L"-%s-%04i.sdfdata") % layer % packageId);
-            std::wstring sdfDataPath = sdfTocPath.parent_path().append(sdfTocPath.stem().wstring()).wstring() + dataFormated;
-
-            if (!IsFileExist(sdfDataPath))
-                return;
-
-            BlockPtr fileBlock = MakeBlockDisk(sdfDataPath);
-
-            std::wstring outFileName = outputDir + AnsiToUnicode(name);
-            std::replace(outFileName.begin(), outFileName.end(), L'/', L'\\');
-            CreateDirectoryRecursively(ExtractFilePath(outFileName));
-
-            BlockPtr resultBlock;
+            std::cout << diff.added.size() << " added, " << diff.changed.size() << " changed, " << diff.removed.size() << " removed" << std::endl;
+            positions = std::move(diff.added);
+            positions.insert(positions.end(), diff.changed.begin(), diff.changed.end());
+        }
+        if (shardCount > 1)
+        {
+            positions = ShardEntries(index, positions, shardIndex, shardCount);
+        }
 
+        MemoryBudget budget(maxMemory);
+        std::mutex outputMutex;
+        std::atomic<size_t> nextEntry(0);
+        std::exception_ptr error;
 
-            if (compSizeArray.size() == 0)
-            {
-                //decompressed
-                resultBlock = MakeBlockPart(fileBlock, packageOffset, decompressedSize);
-            }
-            else
+        auto worker = [&]()
+        {
+            for (size_t item = nextEntry++; item < positions.size(); item = nextEntry++)
             {
-                std::unique_ptr<uint8_t[]> decompressed = std::make_unique<uint8_t[]>(decompressedSize);
-                uint64_t decompOffset = 0;
-                uint64_t compOffset = 0;
-                for (uint64_t compSizePart : compSizeArray)
+                try
                 {
-                    const uint64_t pageSize = 0x10000ull;
-                    uLong decompSizePart = std::min(decompressedSize - decompOffset, pageSize);
-
-                    if (compSizePart == 0 || decompSizePart == compSizePart)
+                    SdfEntry entry = index.Entry(positions[item]);
+                    MemoryReservation reservation(budget, EntryMemoryCost(entry));
                     {
-                        fileBlock->Get<uint8_t>(decompressed.get() + decompOffset, packageOffset + compOffset, decompSizePart);
-                        compSizePart = decompSizePart;
+                        std::lock_guard<std::mutex> lock(outputMutex);
+                        std::cout << entry.name << std::endl;
                     }
-                    else
-                    {
-                        auto compressed = fileBlock->Get<uint8_t>(packageOffset + compOffset, compSizePart);
-                        if (uncompress(decompressed.get() + decompOffset, &decompSizePart, compressed.get(), compSizePart) != Z_OK)
-                            throw std::exception("Uncompress error");
-
-                    }
-                    decompOffset += decompSizePart;
-                    compOffset += compSizePart;
-
+                    ExtractEntry(toc, entry, outputDir, directIo);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    if (!error)
+                        error = std::current_exception();
+                    nextEntry = positions.size();
                 }
-                resultBlock = MakeBlockMemory(std::move(decompressed), decompressedSize);
-            }
-
-            if (useDDS)
-            {
-                SdfDdsHeader ddsHeader = ddsHeaderBlock[ddsType];
-                const int ddsHeaderDataSize = ddsHeader.usedBytes;
-                auto fullDataBlockSize = ddsHeaderDataSize + resultBlock->Size();
-                auto fullDataBlock = std::make_unique<uint8_t[]>(fullDataBlockSize);
-                std::memcpy(fullDataBlock.get(), ddsHeader.bytes, ddsHeaderDataSize);
-                resultBlock->Get(fullDataBlock.get() + ddsHeaderDataSize, 0, resultBlock->Size());
-                resultBlock = MakeBlockMemory(std::move(fullDataBlock), fullDataBlockSize);
-            }
-
-            if (append)
-            {
-                WriteBlockApp(resultBlock, outFileName);
-            }
-            else
-            {
-                WriteBlock(resultBlock, outFileName);
             }
+        };
 
-        });
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < jobs; i++)
+        {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (std::thread &thread : workers)
+        {
+            thread.join();
+        }
+        if (error)
+            std::rethrow_exception(error);
     }
     catch (const std::exception & ex)
     {
         std::cout << "Error: " << ex.what() << std::endl;
     }
     return 0;
-}
\ No newline at end of file
+}
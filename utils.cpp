@@ -1,9 +1,21 @@
 
 #include "utils.h"
+#include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
 #include <Shlobj.h>
 #include <unordered_map>
 #include <memory>
+#include <stdexcept>
+#include <algorithm>
+#include <mutex>
+#include <cstring>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#ifndef IO_REPARSE_TAG_AF_UNIX
+#define IO_REPARSE_TAG_AF_UNIX 0x80000023L
+#endif
 
 
 std::vector<std::wstring> EnumerateDirectory(const std::wstring &directory, const std::wstring &filter)
@@ -93,7 +105,7 @@ void WriteData(const std::wstring &name, const unsigned char *data, uint64_t dat
     s.write((const char*) data, data_size);
     if (!s.good())
     {
-        throw std::exception("Failed to write file");
+        throw std::runtime_error("Failed to write file");
     }
     std::wcout << L">" << name << std::endl;
 }
@@ -104,7 +116,7 @@ void WriteDataApp(const std::wstring &name, const unsigned char *data, uint64_t
     s.write((const char*) data, data_size);
     if (!s.good())
     {
-        throw std::exception("Failed to write file");
+        throw std::runtime_error("Failed to write file");
     }
 }
 
@@ -135,11 +147,271 @@ std::wstring AnsiToUnicode(const std::string &string)
     return result;
 }
 
+PathString NativePath(const std::string &string)
+{
+    return AnsiToUnicode(string);
+}
+std::string NarrowPath(const PathString &path)
+{
+    return UnicodeToAnsi(path);
+}
+
 unsigned long long FileSize(const std::wstring &fileName)
 {
     std::ifstream f(fileName, std::ios::binary);
     f.seekg(0, std::ios_base::end);
     if (!f.good())
-        throw std::exception("Cannot get file size");
+        throw std::runtime_error("Cannot get file size");
     return f.tellg();
-}
\ No newline at end of file
+}
+
+FileHandle OpenFileRead(const std::wstring &fileName, bool directIo)
+{
+    DWORD flags = directIo ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL;
+    HANDLE file = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, flags, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("File open error");
+    return file;
+}
+
+void CloseFile(FileHandle file)
+{
+    CloseHandle(file);
+}
+
+unsigned long long FileSize(FileHandle file)
+{
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+        throw std::runtime_error("Cannot get file size");
+    return size.QuadPart;
+}
+
+void ReadFileAt(FileHandle file, void *data, uint64_t offset, uint64_t size)
+{
+    //explicit offset in OVERLAPPED makes the read independent of the shared file pointer
+    unsigned char *dst = static_cast<unsigned char*>(data);
+    while (size)
+    {
+        DWORD chunk = DWORD(std::min<uint64_t>(size, 0x40000000ull));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(file, dst, chunk, &read, &overlapped) || read != chunk)
+            throw std::runtime_error("File read error");
+        dst += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+uint64_t ReadFileAtDirect(FileHandle file, void *data, uint64_t offset, uint64_t size)
+{
+    unsigned char *dst = static_cast<unsigned char*>(data);
+    uint64_t total = 0;
+    while (size)
+    {
+        DWORD chunk = DWORD(std::min<uint64_t>(size, 0x40000000ull));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD read = 0;
+        if (!ReadFile(file, dst, chunk, &read, &overlapped))
+        {
+            if (GetLastError() == ERROR_HANDLE_EOF)
+                break;
+            throw std::runtime_error("File read error");
+        }
+        total += read;
+        if (read != chunk)
+            break;
+        dst += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+    return total;
+}
+
+FileHandle OpenFileWrite(const std::wstring &fileName, bool append)
+{
+    HANDLE file = CreateFileW(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, append ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("File open error");
+    return file;
+}
+
+void WriteFileAt(FileHandle file, const void *data, uint64_t offset, uint64_t size)
+{
+    const unsigned char *src = static_cast<const unsigned char*>(data);
+    while (size)
+    {
+        DWORD chunk = DWORD(std::min<uint64_t>(size, 0x40000000ull));
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = DWORD(offset);
+        overlapped.OffsetHigh = DWORD(offset >> 32);
+        DWORD written = 0;
+        if (!WriteFile(file, src, chunk, &written, &overlapped) || written != chunk)
+            throw std::runtime_error("File write error");
+        src += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+uint64_t CopyFileRange(FileHandle source, uint64_t sourceOffset, FileHandle target, uint64_t targetOffset, uint64_t size)
+{
+    //no general handle-to-handle range copy on Win32, the caller falls back to user space
+    return 0;
+}
+
+void *AllocateAligned(size_t size, size_t alignment)
+{
+    void *data = _aligned_malloc(size, alignment);
+    if (!data)
+        throw std::bad_alloc();
+    return data;
+}
+
+void FreeAligned(void *data)
+{
+    _aligned_free(data);
+}
+
+const void *MapFileRead(FileHandle file, uint64_t size)
+{
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, DWORD(size >> 32), DWORD(size), nullptr);
+    if (!mapping)
+        throw std::runtime_error("File mapping error");
+    //the view keeps the mapping object alive
+    const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, SIZE_T(size));
+    CloseHandle(mapping);
+    if (!data)
+        throw std::runtime_error("File mapping error");
+    return data;
+}
+
+void UnmapFile(const void *data, uint64_t size)
+{
+    UnmapViewOfFile(data);
+}
+
+static void StartupSockets()
+{
+    static std::once_flag started;
+    std::call_once(started, []()
+    {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+            throw std::runtime_error("Winsock startup error");
+    });
+}
+
+static sockaddr_un LocalSocketAddress(const std::wstring &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::string ansiPath = UnicodeToAnsi(path);
+    if (ansiPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long");
+    std::memcpy(address.sun_path, ansiPath.c_str(), ansiPath.size());
+    return address;
+}
+
+SocketHandle ListenLocalSocket(const std::wstring &path)
+{
+    StartupSockets();
+    sockaddr_un address = LocalSocketAddress(path);
+    //only a stale socket is replaced, AF_UNIX sockets are reparse points with their own tag
+    WIN32_FIND_DATAW findData;
+    HANDLE find = FindFirstFileW(path.c_str(), &findData);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        FindClose(find);
+        if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) || findData.dwReserved0 != IO_REPARSE_TAG_AF_UNIX)
+            throw std::runtime_error("Socket path exists");
+        DeleteFileW(path.c_str());
+    }
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET)
+        throw std::runtime_error("Socket create error");
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        closesocket(listener);
+        throw std::runtime_error("Socket listen error");
+    }
+    return listener;
+}
+
+SocketHandle AcceptLocalSocket(SocketHandle listener)
+{
+    for (;;)
+    {
+        SOCKET client = accept(listener, nullptr, nullptr);
+        if (client != INVALID_SOCKET)
+            return client;
+        int error = WSAGetLastError();
+        if (error == WSAECONNRESET || error == WSAEINTR)
+            continue;
+        if (error != WSAEMFILE && error != WSAENOBUFS)
+            throw std::runtime_error("Socket accept error");
+        //out of sockets or buffers, give running connections a moment to release some
+        Sleep(100);
+    }
+}
+
+SocketHandle ConnectLocalSocket(const std::wstring &path)
+{
+    StartupSockets();
+    sockaddr_un address = LocalSocketAddress(path);
+    SOCKET connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection == INVALID_SOCKET)
+        throw std::runtime_error("Socket create error");
+    if (connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        closesocket(connection);
+        throw std::runtime_error("Socket connect error");
+    }
+    return connection;
+}
+
+void ShutdownSocket(SocketHandle socket)
+{
+    shutdown(socket, SD_BOTH);
+}
+
+void CloseSocket(SocketHandle socket)
+{
+    closesocket(socket);
+}
+
+void SendAll(SocketHandle socket, const void *data, size_t size)
+{
+    const char *src = static_cast<const char*>(data);
+    while (size)
+    {
+        int sent = send(socket, src, int(std::min<size_t>(size, 0x40000000)), 0);
+        if (sent <= 0)
+            throw std::runtime_error("Socket send error");
+        src += sent;
+        size -= sent;
+    }
+}
+
+bool ReceiveAll(SocketHandle socket, void *data, size_t size)
+{
+    char *dst = static_cast<char*>(data);
+    bool first = true;
+    while (size)
+    {
+        int received = recv(socket, dst, int(std::min<size_t>(size, 0x40000000)), 0);
+        if (received == 0 && first)
+            return false;
+        if (received <= 0)
+            throw std::runtime_error("Socket receive error");
+        first = false;
+        dst += received;
+        size -= received;
+    }
+    return true;
+}
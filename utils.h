@@ -7,24 +7,87 @@
 #include <iostream>
 #include <vector>
 
-std::vector<std::wstring> EnumerateDirectory(const std::wstring &directory, const std::wstring &filter = L"*");
+//native path and command line strings: UTF-16 on Windows, UTF-8 bytes elsewhere
+#ifdef _WIN32
+typedef wchar_t PathChar;
+#define PATH_TEXT(text) L##text
+const PathChar PathSeparator = L'\\';
+#else
+typedef char PathChar;
+#define PATH_TEXT(text) text
+const PathChar PathSeparator = '/';
+#endif
+typedef std::basic_string<PathChar> PathString;
 
-std::wstring ExtractFilePath(const std::wstring &file_name);
-std::wstring ExtractFileName(const std::wstring &file_name);
+std::vector<PathString> EnumerateDirectory(const PathString &directory, const PathString &filter = PATH_TEXT("*"));
 
+PathString ExtractFilePath(const PathString &file_name);
+PathString ExtractFileName(const PathString &file_name);
 
-std::wstring Number(uint64_t i);
 
-void WriteData(const std::wstring &name, const unsigned char *data, uint64_t dataSize);
-void WriteDataApp(const std::wstring &name, const unsigned char *data, uint64_t dataSize);
+PathString Number(uint64_t i);
 
-bool IsFileExist(const std::wstring & fileName);
+void WriteData(const PathString &name, const unsigned char *data, uint64_t dataSize);
+void WriteDataApp(const PathString &name, const unsigned char *data, uint64_t dataSize);
 
-void CreateLinkByPath(const std::wstring &newName, const std::wstring &existingName);
+bool IsFileExist(const PathString & fileName);
 
-int CreateDirectoryRecursively(const std::wstring &path);
+void CreateLinkByPath(const PathString &newName, const PathString &existingName);
+
+int CreateDirectoryRecursively(const PathString &path);
 
 std::string UnicodeToAnsi(const std::wstring &string);
 std::wstring AnsiToUnicode(const std::string &string);
 
-unsigned long long FileSize(const std::wstring &fileName);
\ No newline at end of file
+//toc names and other narrow text to native strings and back, no conversion where native is narrow
+PathString NativePath(const std::string &string);
+std::string NarrowPath(const PathString &path);
+
+unsigned long long FileSize(const PathString &fileName);
+
+//platform file handle, reads are positional so one handle can be shared between threads
+#ifdef _WIN32
+typedef void *FileHandle;
+#else
+typedef int FileHandle;
+#endif
+
+FileHandle OpenFileRead(const PathString &fileName, bool directIo = false);
+void CloseFile(FileHandle file);
+unsigned long long FileSize(FileHandle file);
+void ReadFileAt(FileHandle file, void *data, uint64_t offset, uint64_t size);
+//unbuffered read: data, offset and size must be DirectIoAlignment aligned, returns less at end of file
+uint64_t ReadFileAtDirect(FileHandle file, void *data, uint64_t offset, uint64_t size);
+
+//opens for writing, truncating unless append
+FileHandle OpenFileWrite(const PathString &fileName, bool append);
+void WriteFileAt(FileHandle file, const void *data, uint64_t offset, uint64_t size);
+//copies a byte range between files without passing it through user space: reflink on
+//copy-on-write filesystems, kernel copy otherwise; returns bytes copied, the caller copies the rest
+uint64_t CopyFileRange(FileHandle source, uint64_t sourceOffset, FileHandle target, uint64_t targetOffset, uint64_t size);
+
+const size_t DirectIoAlignment = 4096;
+void *AllocateAligned(size_t size, size_t alignment);
+void FreeAligned(void *data);
+
+//read-only mapping of the first size bytes of a file, stays valid after the handle is closed
+const void *MapFileRead(FileHandle file, uint64_t size);
+void UnmapFile(const void *data, uint64_t size);
+
+//local stream sockets (AF_UNIX), used by the extraction server
+#ifdef _WIN32
+typedef uintptr_t SocketHandle;
+#else
+typedef int SocketHandle;
+#endif
+
+SocketHandle ListenLocalSocket(const PathString &path);
+//waits out transient failures (aborted connections, descriptor or buffer exhaustion)
+SocketHandle AcceptLocalSocket(SocketHandle listener);
+SocketHandle ConnectLocalSocket(const PathString &path);
+//ends both directions, wakes a thread blocked on the socket
+void ShutdownSocket(SocketHandle socket);
+void CloseSocket(SocketHandle socket);
+void SendAll(SocketHandle socket, const void *data, size_t size);
+//false if the peer closed the connection before the first byte
+bool ReceiveAll(SocketHandle socket, void *data, size_t size);
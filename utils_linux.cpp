@@ -0,0 +1,508 @@
+
+#include "utils.h"
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+
+//retries calls interrupted by signals
+template <typename Call>
+static auto RetryEintr(const Call &call) -> decltype(call())
+{
+    for (;;)
+    {
+        auto result = call();
+        if (result != -1 || errno != EINTR)
+            return result;
+    }
+}
+
+std::vector<std::string> EnumerateDirectory(const std::string &directory, const std::string &filter)
+{
+    std::vector<std::string> res;
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return res;
+    //raw getdents64 batches many entries per syscall and skips the DIR stream allocation
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(0x10000);
+    for (;;)
+    {
+        long read = syscall(SYS_getdents64, fd, buffer.get(), 0x10000);
+        if (read <= 0)
+            break;
+        for (long position = 0; position < read;)
+        {
+            struct LinuxDirent64
+            {
+                uint64_t d_ino;
+                int64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[1];
+            };
+            const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64*>(buffer.get() + position);
+            position += entry->d_reclen;
+            if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+                continue;
+            if (fnmatch(filter.c_str(), entry->d_name, 0) == 0)
+                res.push_back(directory + entry->d_name);
+        }
+    }
+    close(fd);
+    return res;
+}
+
+
+std::string ExtractFilePath(const std::string &file_name)
+{
+    const size_t last_slash_idx = file_name.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        return file_name.substr(0, last_slash_idx + 1);
+    }
+    else
+    {
+        return "./";
+    }
+}
+std::string ExtractFileName(const std::string &file_name)
+{
+    const size_t last_slash_idx = file_name.rfind('/');
+    if (std::string::npos != last_slash_idx)
+    {
+        return file_name.substr(last_slash_idx + 1, -1);
+    }
+    else
+    {
+        return file_name;
+    }
+}
+
+int CreateDirectoryRecursively(const std::string &path)
+{
+    //walk the components with mkdirat so every level is resolved relative to its parent
+    int parent = open(!path.empty() && path[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (parent < 0)
+        return errno;
+    int result = 0;
+    size_t begin = 0;
+    while (begin < path.size())
+    {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos)
+            end = path.size();
+        std::string component = path.substr(begin, end - begin);
+        begin = end + 1;
+        if (component.empty() || component == ".")
+            continue;
+        if (mkdirat(parent, component.c_str(), 0777) != 0 && errno != EEXIST)
+        {
+            result = errno;
+            break;
+        }
+        int child = openat(parent, component.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (child < 0)
+        {
+            result = errno;
+            break;
+        }
+        close(parent);
+        parent = child;
+    }
+    close(parent);
+    return result;
+}
+
+//copies a byte range between descriptors inside the kernel, returns bytes copied
+static uint64_t CopyRange(int source, loff_t sourceOffset, int target, loff_t targetOffset, uint64_t size)
+{
+    uint64_t copied = 0;
+    while (copied < size)
+    {
+        ssize_t result = RetryEintr([&] { return copy_file_range(source, &sourceOffset, target, &targetOffset, size_t(std::min<uint64_t>(size - copied, 0x40000000)), 0); });
+        if (result <= 0)
+            break;
+        copied += result;
+    }
+    return copied;
+}
+
+void CreateLinkByPath(const std::string &newName, const std::string &existingName)
+{
+    CreateDirectoryRecursively(ExtractFilePath(newName));
+    unlink(newName.c_str());
+
+    if (linkat(AT_FDCWD, existingName.c_str(), AT_FDCWD, newName.c_str(), 0) == 0)
+        return;
+
+    int source = open(existingName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source < 0)
+        return;
+    struct stat info;
+    int target = -1;
+    if (fstat(source, &info) == 0)
+        target = open(newName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, info.st_mode & 0777);
+    if (target >= 0)
+    {
+        if (CopyRange(source, 0, target, 0, info.st_size) != uint64_t(info.st_size))
+        {
+            //copy_file_range unsupported across these filesystems, copy through user space
+            std::unique_ptr<char[]> buffer = std::make_unique<char[]>(0x100000);
+            for (off_t offset = 0; offset < info.st_size;)
+            {
+                ssize_t read = RetryEintr([&] { return pread(source, buffer.get(), 0x100000, offset); });
+                if (read <= 0 || RetryEintr([&] { return pwrite(target, buffer.get(), read, offset); }) != read)
+                    break;
+                offset += read;
+            }
+        }
+        close(target);
+    }
+    close(source);
+}
+
+
+std::string Number(uint64_t i)
+{
+    std::stringstream ss;
+    ss << i;
+    return ss.str();
+}
+
+
+void WriteData(const std::string &name, const unsigned char *data, uint64_t data_size)
+{
+    CreateDirectoryRecursively(ExtractFilePath(name));
+    std::ofstream s(name, std::ios::binary);
+    s.write((const char*) data, data_size);
+    if (!s.good())
+    {
+        throw std::runtime_error("Failed to write file");
+    }
+    std::cout << ">" << name << std::endl;
+}
+
+void WriteDataApp(const std::string &name, const unsigned char *data, uint64_t data_size)
+{
+    std::ofstream s(name, std::ios::binary | std::ios::app);
+    s.write((const char*) data, data_size);
+    if (!s.good())
+    {
+        throw std::runtime_error("Failed to write file");
+    }
+}
+
+bool IsFileExist(const std::string & fileName)
+{
+    return access(fileName.c_str(), R_OK) == 0;
+}
+
+std::string UnicodeToAnsi(const std::wstring &string)
+{
+    //narrow strings are UTF-8 here
+    std::string result;
+    for (wchar_t ch : string)
+    {
+        uint32_t code = uint32_t(ch);
+        if (code < 0x80)
+        {
+            result += char(code);
+        }
+        else if (code < 0x800)
+        {
+            result += char(0xc0 | (code >> 6));
+            result += char(0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000)
+        {
+            result += char(0xe0 | (code >> 12));
+            result += char(0x80 | ((code >> 6) & 0x3f));
+            result += char(0x80 | (code & 0x3f));
+        }
+        else
+        {
+            result += char(0xf0 | (code >> 18));
+            result += char(0x80 | ((code >> 12) & 0x3f));
+            result += char(0x80 | ((code >> 6) & 0x3f));
+            result += char(0x80 | (code & 0x3f));
+        }
+    }
+    return result;
+}
+std::wstring AnsiToUnicode(const std::string &string)
+{
+    std::wstring result;
+    for (size_t i = 0; i < string.size();)
+    {
+        uint8_t lead = uint8_t(string[i]);
+        size_t length = lead < 0x80 ? 1 : lead < 0xe0 ? 2 : lead < 0xf0 ? 3 : 4;
+        uint32_t code = length == 1 ? lead : length == 2 ? lead & 0x1f : length == 3 ? lead & 0x0f : lead & 0x07;
+        for (size_t k = 1; k < length && i + k < string.size(); k++)
+        {
+            code = (code << 6) | (uint8_t(string[i + k]) & 0x3f);
+        }
+        result += wchar_t(code);
+        i += length;
+    }
+    return result;
+}
+
+std::string NativePath(const std::string &string)
+{
+    return string;
+}
+std::string NarrowPath(const std::string &path)
+{
+    return path;
+}
+
+unsigned long long FileSize(const std::string &fileName)
+{
+    struct stat info;
+    if (stat(fileName.c_str(), &info) != 0)
+        throw std::runtime_error("Cannot get file size");
+    return info.st_size;
+}
+
+FileHandle OpenFileRead(const std::string &fileName, bool directIo)
+{
+    int file = -1;
+    if (directIo)
+    {
+        file = open(fileName.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+        //filesystems without O_DIRECT support (tmpfs) fall back to buffered reads
+        if (file < 0 && errno != EINVAL)
+            throw std::runtime_error("File open error");
+    }
+    if (file < 0)
+        file = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+        throw std::runtime_error("File open error");
+    return file;
+}
+
+void CloseFile(FileHandle file)
+{
+    close(file);
+}
+
+unsigned long long FileSize(FileHandle file)
+{
+    struct stat info;
+    if (fstat(file, &info) != 0)
+        throw std::runtime_error("Cannot get file size");
+    return info.st_size;
+}
+
+void ReadFileAt(FileHandle file, void *data, uint64_t offset, uint64_t size)
+{
+    if (ReadFileAtDirect(file, data, offset, size) != size)
+        throw std::runtime_error("File read error");
+}
+
+uint64_t ReadFileAtDirect(FileHandle file, void *data, uint64_t offset, uint64_t size)
+{
+    unsigned char *dst = static_cast<unsigned char*>(data);
+    uint64_t total = 0;
+    while (total < size)
+    {
+        size_t chunk = size_t(std::min<uint64_t>(size - total, 0x40000000ull));
+        ssize_t read = RetryEintr([&] { return pread(file, dst + total, chunk, off_t(offset + total)); });
+        if (read < 0)
+            throw std::runtime_error("File read error");
+        if (read == 0)
+            break;
+        total += read;
+    }
+    return total;
+}
+
+FileHandle OpenFileWrite(const std::string &fileName, bool append)
+{
+    int file = open(fileName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0666);
+    if (file < 0)
+        throw std::runtime_error("File open error");
+    return file;
+}
+
+void WriteFileAt(FileHandle file, const void *data, uint64_t offset, uint64_t size)
+{
+    const unsigned char *src = static_cast<const unsigned char*>(data);
+    uint64_t total = 0;
+    while (total < size)
+    {
+        size_t chunk = size_t(std::min<uint64_t>(size - total, 0x40000000ull));
+        ssize_t written = RetryEintr([&] { return pwrite(file, src + total, chunk, off_t(offset + total)); });
+        if (written <= 0)
+            throw std::runtime_error("File write error");
+        total += written;
+    }
+}
+
+uint64_t CopyFileRange(FileHandle source, uint64_t sourceOffset, FileHandle target, uint64_t targetOffset, uint64_t size)
+{
+    uint64_t cloned = 0;
+    struct stat sourceInfo;
+    struct stat targetInfo;
+    if (fstat(source, &sourceInfo) == 0 && fstat(target, &targetInfo) == 0 && targetInfo.st_blksize > 0)
+    {
+        //FICLONERANGE needs block aligned offsets and length, unless the range ends at source EOF
+        uint64_t blockSize = uint64_t(targetInfo.st_blksize);
+        if (sourceOffset % blockSize == 0 && targetOffset % blockSize == 0)
+        {
+            uint64_t length = sourceOffset + size == uint64_t(sourceInfo.st_size) ? size : size - size % blockSize;
+            file_clone_range range = {};
+            range.src_fd = source;
+            range.src_offset = sourceOffset;
+            range.src_length = length;
+            range.dest_offset = targetOffset;
+            if (length && ioctl(target, FICLONERANGE, &range) == 0)
+                cloned = length;
+        }
+    }
+    return cloned + CopyRange(source, loff_t(sourceOffset + cloned), target, loff_t(targetOffset + cloned), size - cloned);
+}
+
+void *AllocateAligned(size_t size, size_t alignment)
+{
+    void *data = nullptr;
+    if (posix_memalign(&data, alignment, size) != 0)
+        throw std::bad_alloc();
+    return data;
+}
+
+void FreeAligned(void *data)
+{
+    free(data);
+}
+
+const void *MapFileRead(FileHandle file, uint64_t size)
+{
+    void *data = mmap(nullptr, size_t(size), PROT_READ, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("File mapping error");
+    return data;
+}
+
+void UnmapFile(const void *data, uint64_t size)
+{
+    munmap(const_cast<void*>(data), size_t(size));
+}
+
+static sockaddr_un LocalSocketAddress(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long");
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+SocketHandle ListenLocalSocket(const std::string &path)
+{
+    sockaddr_un address = LocalSocketAddress(path);
+    //only a stale socket is replaced, never a file that happens to sit at the path
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0)
+    {
+        if (!S_ISSOCK(info.st_mode))
+            throw std::runtime_error("Socket path exists");
+        unlink(path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0)
+        throw std::runtime_error("Socket create error");
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        close(listener);
+        throw std::runtime_error("Socket listen error");
+    }
+    return listener;
+}
+
+SocketHandle AcceptLocalSocket(SocketHandle listener)
+{
+    for (;;)
+    {
+        int client = RetryEintr([&] { return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC); });
+        if (client >= 0)
+            return client;
+        if (errno == ECONNABORTED || errno == EPROTO)
+            continue;
+        if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM)
+            throw std::runtime_error("Socket accept error");
+        //out of descriptors or memory, give running connections a moment to release some
+        usleep(100000);
+    }
+}
+
+SocketHandle ConnectLocalSocket(const std::string &path)
+{
+    sockaddr_un address = LocalSocketAddress(path);
+    int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection < 0)
+        throw std::runtime_error("Socket create error");
+    if (RetryEintr([&] { return connect(connection, reinterpret_cast<sockaddr*>(&address), sizeof(address)); }) != 0)
+    {
+        close(connection);
+        throw std::runtime_error("Socket connect error");
+    }
+    return connection;
+}
+
+void ShutdownSocket(SocketHandle socket)
+{
+    shutdown(socket, SHUT_RDWR);
+}
+
+void CloseSocket(SocketHandle socket)
+{
+    close(socket);
+}
+
+void SendAll(SocketHandle socket, const void *data, size_t size)
+{
+    const char *src = static_cast<const char*>(data);
+    while (size)
+    {
+        //MSG_NOSIGNAL: a vanished peer is an error, not a SIGPIPE
+        ssize_t sent = RetryEintr([&] { return send(socket, src, size, MSG_NOSIGNAL); });
+        if (sent <= 0)
+            throw std::runtime_error("Socket send error");
+        src += sent;
+        size -= sent;
+    }
+}
+
+bool ReceiveAll(SocketHandle socket, void *data, size_t size)
+{
+    char *dst = static_cast<char*>(data);
+    bool first = true;
+    while (size)
+    {
+        ssize_t received = RetryEintr([&] { return recv(socket, dst, size, 0); });
+        if (received == 0 && first)
+            return false;
+        if (received <= 0)
+            throw std::runtime_error("Socket receive error");
+        first = false;
+        dst += received;
+        size -= received;
+    }
+    return true;
+}